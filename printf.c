@@ -46,6 +46,12 @@
 #include "minmax.h"
 #include "printf.h"
 
+// Compile with -DLIN_PRINTF_HOOKS=1 to enable the hooks of lin_vsnprintf_ex().
+// When disabled, no hook code is compiled in at all.
+#ifndef LIN_PRINTF_HOOKS
+#define LIN_PRINTF_HOOKS 0
+#endif
+
 // internal flag definitions
 #define FLAGS_ZEROPAD   (1U <<  0U)
 #define FLAGS_LEFT      (1U <<  1U)
@@ -54,6 +60,8 @@
 #define FLAGS_HASH      (1U <<  4U)
 #define FLAGS_UPPERCASE (1U <<  5U)
 #define FLAGS_WIDTH     (1U << 11U)
+#define FLAGS_WIDTH_ARG (1U << 12U) // width is passed as argument ('*')
+#define FLAGS_PREC_ARG  (1U << 13U) // precision is passed as argument ('*')
 
 // these are more like type modifiers; the exact type also depends on the
 // conversion specifier
@@ -68,55 +76,187 @@ enum {
     TYPE_PTR,
     TYPE_I32,
     TYPE_I64,
+    TYPE_I128,
 };
 
+// The encoding of struct lin_format_spec is shared with printf.hpp.
+_Static_assert(FLAGS_ZEROPAD == LIN_SPEC_ZEROPAD && FLAGS_LEFT == LIN_SPEC_LEFT &&
+               FLAGS_PLUS == LIN_SPEC_PLUS && FLAGS_SPACE == LIN_SPEC_SPACE &&
+               FLAGS_HASH == LIN_SPEC_HASH &&
+               FLAGS_WIDTH_ARG == LIN_SPEC_WIDTH_ARG &&
+               FLAGS_PREC_ARG == LIN_SPEC_PREC_ARG, "");
+_Static_assert((int)TYPE_NONE == LIN_SPEC_TYPE_NONE &&
+               (int)TYPE_CHAR == LIN_SPEC_TYPE_CHAR &&
+               (int)TYPE_SHORT == LIN_SPEC_TYPE_SHORT &&
+               (int)TYPE_LONG == LIN_SPEC_TYPE_LONG &&
+               (int)TYPE_LLONG == LIN_SPEC_TYPE_LLONG &&
+               (int)TYPE_INTMAX == LIN_SPEC_TYPE_INTMAX &&
+               (int)TYPE_SIZE == LIN_SPEC_TYPE_SIZE &&
+               (int)TYPE_PTR == LIN_SPEC_TYPE_PTR &&
+               (int)TYPE_I32 == LIN_SPEC_TYPE_I32 &&
+               (int)TYPE_I64 == LIN_SPEC_TYPE_I64 &&
+               (int)TYPE_I128 == LIN_SPEC_TYPE_I128, "");
+
 // If this fails, you need to adjust handling of all cases where ptrdiff_t is
 // used as signed version of size_t (and reverse).
 _Static_assert(sizeof(ptrdiff_t) == sizeof(size_t), "");
 
+// If this fails, you need to adjust ntoa_format() and the digit functions it
+// uses, which work on uint64_t.
+_Static_assert(UINTMAX_MAX == UINT64_MAX, "");
+
+// Output target. Output goes to dst, until end is reached. If flush is set,
+// it is called to make space when the buffer is full; it must either make
+// dst < end and return true, or return false, in which case the rest of the
+// output is dropped (but still counted).
 struct buf {
     char *dst;
     char *end;
     size_t idx;
     bool overflow;
+    bool (*flush)(struct buf *buf);
+    size_t stop;    // if != 0, stop formatting once idx >= stop
+    // If set, out_str() calls this to output a string by reference instead of
+    // copying it. Returns false if the string must be copied.
+    bool (*ref)(struct buf *buf, const char *s, size_t l);
+#if LIN_PRINTF_HOOKS
+    const struct lin_printf_hooks *hooks;
+    struct lin_conv_info *info; // current conversion (NULL if no hooks)
+#endif
 };
 
+// Record statistics about the current conversion for lin_vsnprintf_ex().
+#if LIN_PRINTF_HOOKS
+#define HOOK_PAD(buf, n) \
+    do { if ((buf)->info) (buf)->info->pad_bytes += (n); } while (0)
+#define HOOK_FP(buf, path) \
+    do { if ((buf)->info) (buf)->info->fp_path = (path); } while (0)
+#define HOOK_BIGNUM(buf) \
+    do { if ((buf)->info) (buf)->info->bignum_passes++; } while (0)
+#else
+#define HOOK_PAD(buf, n)    ((void)0)
+#define HOOK_FP(buf, path)  ((void)0)
+#define HOOK_BIGNUM(buf)    ((void)0)
+#endif
+
+// Make space with the flush callback. If there is none, or it fails, all
+// further output is dropped (see out_discard()).
+static bool out_flush(struct buf *buf)
+{
+    if (buf->flush && buf->flush(buf))
+        return true;
+    buf->flush = NULL;
+    return false;
+}
+
 static void outc(struct buf *buf, char c)
 {
-    if (buf->dst < buf->end)
+    if (buf->dst < buf->end || out_flush(buf))
         *buf->dst++ = c;
     buf->idx++;
     if (!buf->idx)
         buf->overflow = true;
 }
 
-static void out(struct buf *buf, const char *s, size_t l)
+// Account for l bytes of output without writing them.
+static void out_skip(struct buf *buf, size_t l)
 {
-    size_t space = buf->end - buf->dst;
-    if (space > l)
-        space = l;
-    memcpy(buf->dst, s, space);
-    buf->dst += space;
     buf->idx += l;
     if (buf->idx < l)
         buf->overflow = true;
 }
 
-static void pad(struct buf *f, char c, int w, int l, int fl)
+// Whether all further output is dropped (no space left, and no flush callback
+// to make space), so that only its length needs to be computed.
+static inline bool out_discard(struct buf *buf)
 {
-    char pad[256];
-    if (fl & (FLAGS_LEFT | FLAGS_ZEROPAD) || l >= w)
+    return buf->dst == buf->end && !buf->flush;
+}
+
+// Whether the rest of the output can be skipped (see lin_vsnprintf_trunc()).
+static inline bool out_stop(struct buf *buf)
+{
+    return buf->stop && buf->idx >= buf->stop;
+}
+
+static void out(struct buf *buf, const char *s, size_t l)
+{
+    out_skip(buf, l);
+    while (1) {
+        size_t space = buf->end - buf->dst;
+        if (space >= l) {
+            memcpy(buf->dst, s, l);
+            buf->dst += l;
+            return;
+        }
+        memcpy(buf->dst, s, space);
+        buf->dst += space;
+        s += space;
+        l -= space;
+        if (!out_flush(buf))
+            return;
+    }
+}
+
+// Output a string argument (which stays valid until the output is consumed).
+static void out_str(struct buf *buf, const char *s, size_t l)
+{
+    if (buf->ref && buf->ref(buf, s, l)) {
+        out_skip(buf, l);
         return;
-    l = w - l;
-    memset(pad, c, l > sizeof pad ? sizeof pad : l);
-    for (; l >= sizeof pad; l -= sizeof pad)
-        out(f, pad, sizeof pad);
-    out(f, pad, l);
+    }
+    out(buf, s, l);
+}
+
+// Return a pointer to write l bytes directly to the output, or NULL if there
+// is not enough space in the current buffer window. If successful, the caller
+// must write exactly l bytes and then call out_commit(buf, l).
+static inline char *out_reserve(struct buf *buf, size_t l)
+{
+    return buf->end - buf->dst >= l ? buf->dst : NULL;
+}
+
+static inline void out_commit(struct buf *buf, size_t l)
+{
+    buf->dst += l;
+    out_skip(buf, l);
 }
 
+// Output l times c.
 static void out_pad(struct buf *buf, char c, size_t l)
 {
-    pad(buf, c, l, 0, 0);
+    char pad[256], *d;
+    if (out_discard(buf)) {
+        out_skip(buf, l);
+        return;
+    }
+    if ((d = out_reserve(buf, l))) {
+        memset(d, c, l);
+        out_commit(buf, l);
+        return;
+    }
+    memset(pad, c, l > sizeof pad ? sizeof pad : l);
+    for (; l >= sizeof pad; l -= sizeof pad) {
+        // Only count the rest of a huge width once nothing is written anymore.
+        if (out_discard(buf) || out_stop(buf))
+            break;
+        out(buf, pad, sizeof pad);
+    }
+    if (out_discard(buf) || out_stop(buf)) {
+        out_skip(buf, l);
+        return;
+    }
+    out(buf, pad, l);
+}
+
+// Field width padding: output c to pad l bytes to the width w, unless one of
+// the flags FLAGS_LEFT or FLAGS_ZEROPAD is set in fl.
+static void pad(struct buf *f, char c, int w, int l, int fl)
+{
+    if (fl & (FLAGS_LEFT | FLAGS_ZEROPAD) || l >= w)
+        return;
+    HOOK_PAD(f, w - l);
+    out_pad(f, c, w - l);
 }
 
 // internal ASCII string to unsigned int conversion
@@ -129,41 +269,174 @@ static inline unsigned int fmt_atoi(const char **str)
     return MIN(i, INT_MAX);
 }
 
-static char convert_digit(unsigned int flags, unsigned int digit)
+static const char digit_pairs[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static const char lower_digits[16] = "0123456789abcdef";
+static const char upper_digits[16] = "0123456789ABCDEF";
+
+static const uint64_t pow10_64[20] = {
+    UINT64_C(1), UINT64_C(10), UINT64_C(100), UINT64_C(1000),
+    UINT64_C(10000), UINT64_C(100000), UINT64_C(1000000),
+    UINT64_C(10000000), UINT64_C(100000000), UINT64_C(1000000000),
+    UINT64_C(10000000000), UINT64_C(100000000000),
+    UINT64_C(1000000000000), UINT64_C(10000000000000),
+    UINT64_C(100000000000000), UINT64_C(1000000000000000),
+    UINT64_C(10000000000000000), UINT64_C(100000000000000000),
+    UINT64_C(1000000000000000000), UINT64_C(10000000000000000000),
+};
+
+// Number of significant bits in v (at least 1).
+static inline int bit_length(uint64_t v)
 {
-    return digit < 10 ? '0' + digit
-                      : (flags & FLAGS_UPPERCASE ? 'A' : 'a') + (digit - 10);
+#if defined(__GNUC__) && ULLONG_MAX == UINT64_MAX
+    return 64 - __builtin_clzll(v | 1);
+#else
+    int n = 1;
+    for (int sh = 32; sh; sh /= 2) {
+        if (v >> sh) {
+            v >>= sh;
+            n += sh;
+        }
+    }
+    return n;
+#endif
 }
 
-// internal itoa format
-static void ntoa_format(struct buf *buffer, uintmax_t value, bool negative,
-                        unsigned int base, int prec, int width, unsigned int flags)
+// Number of digits of v in the given base (1 for v==0).
+static inline int count_digits(uint64_t v, unsigned int base)
 {
-    // Worst case: base 2, plus terminating \0
-    char tmp[sizeof(value) * 8 + 1];
-    int pos = sizeof(tmp);
+    int bits = bit_length(v);
+    switch (base) {
+    case 16: return (bits + 3) / 4;
+    case 8:  return (bits + 2) / 3;
+    case 2:  return bits;
+    }
+    // floor(log10(2^bits)) is either the number of digits or one less.
+    int n = (bits * 1233) >> 12;
+    return n + ((v | 1) >= pow10_64[n]);
+}
 
-    tmp[--pos] = '\0';
+// Write the 8 decimal digits (with leading zeros) of v < 10^8 to s[0..8).
+// All digits are computed at once in the lanes of a 64 bit integer (SWAR): v
+// is split into 4 digit halves (32 bit lanes), these into 2 digit parts
+// (16 bit lanes), and these into digits (8 bit lanes). The multiply-shifts
+// are exact divisions by 100 and 10 for the value ranges in the lanes.
+static inline void write_dec8(char *s, uint32_t v)
+{
+    uint64_t m = (v / 10000) | ((uint64_t)(v % 10000) << 32);
+    uint64_t h = ((m * 10486) >> 20) & ((UINT64_C(0x7F) << 32) | 0x7F);
+    m = ((m - h * 100) << 16) | h;
+    uint64_t t = ((m * 103) >> 10) & UINT64_C(0x000F000F000F000F);
+    m = (t | ((m - t * 10) << 8)) + UINT64_C(0x3030303030303030);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(s, &m, 8);
+#else
+    for (int i = 0; i < 8; i++)
+        s[i] = (char)(m >> (i * 8));
+#endif
+}
 
-    if (value > UINT_MAX) {
-        do {
-            assert(pos > 0);
-            tmp[--pos] = convert_digit(flags, value % base);
-            value /= base;
-        } while (value);
+// Write the decimal digits of v into s[0..n); n must be count_digits(v, 10).
+// Full groups of 8 digits are produced with write_dec8(), the leading digits
+// 2 per step. Uses 32 bit arithmetic for all but one 64 bit division per 8
+// digits.
+static void write_dec(char *s, int n, uint64_t v)
+{
+    char *p = s + n;
+    while (v > UINT32_MAX) {
+        p -= 8;
+        write_dec8(p, v % 100000000);
+        v /= 100000000;
+    }
+    uint32_t x = v;
+    if (x >= 100000000) {
+        p -= 8;
+        write_dec8(p, x % 100000000);
+        x /= 100000000;
+    }
+    while (x >= 100) {
+        p -= 2;
+        memcpy(p, &digit_pairs[(x % 100) * 2], 2);
+        x /= 100;
+    }
+    if (x >= 10) {
+        p -= 2;
+        memcpy(p, &digit_pairs[x * 2], 2);
     } else {
-        // uses 32 bit arithmetic, which could be faster on many platforms
-        unsigned int uvalue = value;
-        do {
-            assert(pos > 0);
-            tmp[--pos] = convert_digit(flags, uvalue % base);
-            uvalue /= base;
-        } while (uvalue);
+        *--p = '0' + x;
+    }
+    assert(p == s);
+}
+
+// Write the n digits of v in the given base into s[0..n) (see count_digits()).
+// n can be 0 to write nothing.
+static void write_digits(char *s, int n, uint64_t v, unsigned int base,
+                         unsigned int flags)
+{
+    if (!n)
+        return;
+    if (base == 10) {
+        write_dec(s, n, v);
+        return;
+    }
+    const char *digits = flags & FLAGS_UPPERCASE ? upper_digits : lower_digits;
+    int shift = base == 16 ? 4 : base == 8 ? 3 : 1;
+    unsigned int mask = base - 1;
+    while (n--) {
+        s[n] = digits[v & mask];
+        v >>= shift;
     }
+}
 
-    char *number = tmp + pos;
-    int len = sizeof(tmp) - pos - 1;
+#ifdef __SIZEOF_INT128__
+// Write the digits of v in the given base so that they end right before end,
+// and return their number (at most 128). Decimal digits are produced in chunks
+// of 19 by dividing by 10^19, so only the (up to 2) chunk divisions use 128 bit
+// arithmetic.
+static int write_digits128(char *end, unsigned __int128 v, unsigned int base,
+                           unsigned int flags)
+{
+    char *s = end;
+    if (base == 10) {
+        const uint64_t chunk = UINT64_C(10000000000000000000);
+        while (v >> 64) {
+            unsigned __int128 q = v / chunk;
+            uint64_t r = (uint64_t)(v - q * chunk);
+            int n = count_digits(r, 10);
+            s -= 19;
+            memset(s, '0', 19 - n);
+            write_dec(s + 19 - n, n, r);
+            v = q;
+        }
+        int n = count_digits((uint64_t)v, 10);
+        s -= n;
+        write_dec(s, n, (uint64_t)v);
+    } else {
+        const char *digits = flags & FLAGS_UPPERCASE ? upper_digits : lower_digits;
+        int shift = base == 16 ? 4 : base == 8 ? 3 : 1;
+        unsigned int mask = base - 1;
+        do {
+            *--s = digits[v & mask];
+            v >>= shift;
+        } while (v);
+    }
+    return end - s;
+}
+#endif
 
+// internal itoa format
+// If digits is not NULL, it contains the len pre-rendered digits of the
+// number, and value is only used to check whether it is 0. Otherwise len must
+// be count_digits(value, base).
+static void ntoa_layout(struct buf *buffer, uintmax_t value, const char *digits,
+                        int len, bool negative, unsigned int base, int prec,
+                        int width, unsigned int flags)
+{
     // If precision is forced to 0, don't output anything. Unless it's the
     // crazy corner case of "%#.0o", which must output a single "0".
     if (prec == 0 && !value && !(base == 8 && (flags & FLAGS_HASH)))
@@ -206,18 +479,61 @@ static void ntoa_format(struct buf *buffer, uintmax_t value, bool negative,
 
     size_t total_len = prefix_len + zero_pad + len;
     size_t space_pad = width > total_len ? width - total_len : 0;
+    HOOK_PAD(buffer, space_pad + (flags & FLAGS_ZEROPAD ? zero_pad : 0));
+
+    if (out_discard(buffer)) {
+        out_skip(buffer, total_len + space_pad);
+        return;
+    }
+
+    // Write everything straight to its final position if it fits.
+    char *d = out_reserve(buffer, total_len + space_pad);
+    if (d) {
+        if (!(flags & FLAGS_LEFT)) {
+            memset(d, ' ', space_pad);
+            d += space_pad;
+        }
+        memcpy(d, prefix, prefix_len);
+        d += prefix_len;
+        memset(d, '0', zero_pad);
+        d += zero_pad;
+        if (digits) {
+            memcpy(d, digits, len);
+        } else {
+            write_digits(d, len, value, base, flags);
+        }
+        d += len;
+        if ((flags & FLAGS_LEFT))
+            memset(d, ' ', space_pad);
+        out_commit(buffer, total_len + space_pad);
+        return;
+    }
+
+    // Worst case: base 2
+    char number[sizeof(value) * 8];
+    if (!digits) {
+        write_digits(number, len, value, base, flags);
+        digits = number;
+    }
 
     if (!(flags & FLAGS_LEFT))
         out_pad(buffer, ' ', space_pad);
 
     out(buffer, prefix, prefix_len);
     out_pad(buffer, '0', zero_pad);
-    out(buffer, number, len);
+    out(buffer, digits, len);
 
     if ((flags & FLAGS_LEFT))
         out_pad(buffer, ' ', space_pad);
 }
 
+static void ntoa_format(struct buf *buffer, uintmax_t value, bool negative,
+                        unsigned int base, int prec, int width, unsigned int flags)
+{
+    ntoa_layout(buffer, value, NULL, count_digits(value, base), negative, base,
+                prec, width, flags);
+}
+
 static const char xdigits[16] = "0123456789ABCDEF";
 
 static char *fmt_u(uintmax_t x, char *s)
@@ -230,266 +546,671 @@ static char *fmt_u(uintmax_t x, char *s)
     return s;
 }
 
-/* Do not override this check. The floating point printing code below
- * depends on the float.h constants being right. If they are wrong, it
- * may overflow the stack. */
-#if LDBL_MANT_DIG == 53
-typedef char compiler_defines_long_double_incorrectly[9 - (int) sizeof(long double)];
-#endif
+// Like fmt_u(), but uses the faster write_dec().
+static char *fmt_u64(uint64_t x, char *s)
+{
+    if (!x)
+        return s;
+    int n = count_digits(x, 10);
+    write_dec(s - n, n, x);
+    return s - n;
+}
 
-static int fmt_fp(struct buf *f, long double y, int w, int p, int fl, int t)
+// Fill s[0..n) with c (nothing if n <= 0), and return the end.
+static inline char *put_pad(char *s, char c, int n)
 {
-    uint32_t big[(LDBL_MANT_DIG + 28) / 29 + 1          // mantissa expansion
-                 + (LDBL_MAX_EXP + LDBL_MANT_DIG + 28 + 8) / 9]; // exponent expansion
-    uint32_t *a, *d, *r, *z;
-    int e2 = 0, e, i, j, l;
-    char buf[9 + LDBL_MANT_DIG / 4], *s;
-    const char *prefix = "-0X+0X 0X-0x+0x 0x";
-    int pl;
-    char ebuf0[3 * sizeof(int)], *ebuf = &ebuf0[3 * sizeof(int)], *estr;
+    if (n <= 0)
+        return s;
+    memset(s, c, n);
+    return s + n;
+}
 
-    pl = 1;
-    if (signbit(y)) {
-        y = -y;
-    } else if (fl & FLAGS_PLUS) {
-        prefix += 3;
-    } else if (fl & FLAGS_SPACE) {
-        prefix += 6;
+static inline char *put(char *s, const char *src, int n)
+{
+    memcpy(s, src, n);
+    return s + n;
+}
+
+// Write the number for fmt_dec() (without prefix and padding) to s, and return
+// the end. estr[0..el) is the exponent part for 'e' style.
+static char *put_dec(char *s, const char *d, int nd, int x, int p, bool point,
+                     int t, const char *estr, int el)
+{
+    if ((t | 32) == 'f') {
+        if (x < 0) {
+            *s++ = '0';
+            if (point)
+                *s++ = '.';
+            s = put_pad(s, '0', -x - 1);
+            s = put(s, d, nd);
+            s = put_pad(s, '0', p - (-x - 1) - nd);
+        } else {
+            int n = MIN(nd, x + 1);
+            s = put(s, d, n);
+            s = put_pad(s, '0', x + 1 - n);
+            if (point)
+                *s++ = '.';
+            s = put(s, d + n, nd - n);
+            s = put_pad(s, '0', p - (nd - n));
+        }
     } else {
-        prefix++, pl = 0;
+        *s++ = d[0];
+        if (point)
+            *s++ = '.';
+        s = put(s, d + 1, nd - 1);
+        s = put_pad(s, '0', p - (nd - 1));
+        s = put(s, estr, el);
     }
+    return s;
+}
 
-    if (!isfinite(y)) {
-        char *s = (t & 32) ? "inf" : "INF";
-        if (y != y)
-            s = (t & 32) ? "nan" : "NAN";
-        pad(f, ' ', w, 3 + pl, fl & ~FLAGS_ZEROPAD);
-        out(f, prefix, pl);
-        out(f, s, 3);
-        pad(f, ' ', w, 3 + pl, fl ^ FLAGS_LEFT);
-        return MAX(w, 3 + pl);
-    }
+// Output a decimal number, given as digit string d[0..nd) with no leading
+// zeros (except for the value 0 itself). d[0] has the decimal position x, i.e.
+// the value is d[0].d[1]... * 10^x. t selects 'f' or 'e' style (the case of t
+// is used for the exponent character), p is the number of digits after the
+// radix point (at most FMT_DEC_MAX_PREC). Missing digits are padded with '0';
+// for 'f' style, the caller must ensure that no digit is after the requested
+// precision.
+#define FMT_DEC_MAX_PREC 24
+
+static int fmt_dec(struct buf *f, const char *prefix, int pl, const char *d,
+                   int nd, int x, int w, int p, int fl, int t)
+{
+    char ebuf0[3 * sizeof(int)], *ebuf = &ebuf0[3 * sizeof(int)], *estr = ebuf;
+    bool point = p || (fl & FLAGS_HASH);
+    int l = 1 + p + point;
 
-    y = frexpl(y, &e2) * 2;
-    if (y)
-        e2--;
+    assert(p <= FMT_DEC_MAX_PREC);
 
-    if ((t | 32) == 'a') {
-        long double round = 8.0;
-        int re;
+    if ((t | 32) == 'f') {
+        if (x > 0)
+            l += x;
+    } else {
+        estr = fmt_u(x < 0 ? -x : x, ebuf);
+        while (ebuf - estr < 2)
+            *--estr = '0';
+        *--estr = (x < 0 ? '-' : '+');
+        *--estr = t;
+        l += ebuf - estr;
+    }
 
-        if (t & 32)
-            prefix += 9;
-        pl += 2;
+    if (out_discard(f)) {
+        HOOK_PAD(f, MAX(0, w - (pl + l)));
+        out_skip(f, MAX(w, pl + l));
+        return MAX(w, pl + l);
+    }
 
-        if (p < 0 || p >= LDBL_MANT_DIG / 4 - 1)
-            re = 0;
-        else
-            re = LDBL_MANT_DIG / 4 - 1 - p;
-
-        if (re) {
-            round *= 1 << (LDBL_MANT_DIG % 4);
-            while (re--)
-                round *= 16;
-            if (*prefix == '-') {
-                y = -y;
-                y -= round;
-                y += round;
-                y = -y;
-            } else {
-                y += round;
-                y -= round;
-            }
-        }
+    // Write everything straight to its final position if it fits.
+    char *o = out_reserve(f, MAX(w, pl + l));
+    if (o) {
+        char *s = o;
+        int n = w - (pl + l);
+        HOOK_PAD(f, MAX(0, n));
+        if (!(fl & (FLAGS_LEFT | FLAGS_ZEROPAD)))
+            s = put_pad(s, ' ', n);
+        s = put(s, prefix, pl);
+        if ((fl & FLAGS_ZEROPAD) && !(fl & FLAGS_LEFT))
+            s = put_pad(s, '0', n);
+        s = put_dec(s, d, nd, x, p, point, t, estr, ebuf - estr);
+        if ((fl & FLAGS_LEFT) && !(fl & FLAGS_ZEROPAD))
+            s = put_pad(s, ' ', n);
+        assert(s - o == MAX(w, pl + l));
+        out_commit(f, s - o);
+        return MAX(w, pl + l);
+    }
 
-        estr = fmt_u(e2 < 0 ? -e2 : e2, ebuf);
-        if (estr == ebuf)
-            *--estr = '0';
-        *--estr = (e2 < 0 ? '-' : '+');
-        *--estr = t + ('p' - 'a');
+    char tmp[2 + FMT_DEC_MAX_PREC + DBL_MAX_10_EXP + sizeof(ebuf0)];
+    assert(l <= sizeof(tmp));
 
-        s = buf;
-        do {
-            int x = y;
-            *s++ = xdigits[x] | (t & 32);
-            y = 16 * (y - x);
-            if (s - buf == 1 && (y || p > 0 || (fl & FLAGS_HASH)))
-                *s++ = '.';
-        } while (y);
+    pad(f, ' ', w, pl + l, fl);
+    out(f, prefix, pl);
+    pad(f, '0', w, pl + l, fl ^ FLAGS_ZEROPAD);
+    out(f, tmp, put_dec(tmp, d, nd, x, p, point, t, estr, ebuf - estr) - tmp);
+    pad(f, ' ', w, pl + l, fl ^ FLAGS_LEFT);
 
-        if (p > INT_MAX - 2 - (ebuf - estr) - pl)
-            return -1;
-        if (p && s - buf - 2 < p)
-            l = (p + 2) + (ebuf - estr);
-        else
-            l = (s - buf) + (ebuf - estr);
+    return MAX(w, pl + l);
+}
 
-        pad(f, ' ', w, pl + l, fl);
-        out(f, prefix, pl);
-        pad(f, '0', w, pl + l, fl ^ FLAGS_ZEROPAD);
-        out(f, buf, s - buf);
-        pad(f, '0', l - (ebuf - estr) - (s - buf), 0, 0);
-        out(f, estr, ebuf - estr);
-        pad(f, ' ', w, pl + l, fl ^ FLAGS_LEFT);
-        return MAX(w, pl + l);
+// Whether double is IEEE 754 binary64 (required by fmt_shortest()).
+#define DBL_IEEE754 (FLT_RADIX == 2 && DBL_MANT_DIG == 53 && \
+                     DBL_MAX_EXP == 1024 && DBL_MIN_EXP == -1021)
+
+// Return the integer mantissa m of the finite y >= 0, and set *e2 such that
+// y == m * 2^*e2 (m < 2^DBL_MANT_DIG, and not normalized for subnormals).
+static uint64_t dbl_mantissa(double y, int *e2)
+{
+#if DBL_IEEE754
+    uint64_t bits;
+    memcpy(&bits, &y, sizeof(bits));
+    int ieee_exp = (bits >> 52) & 0x7FF;
+    uint64_t m = bits & ((UINT64_C(1) << 52) - 1);
+    if (ieee_exp) {
+        m |= UINT64_C(1) << 52;
+        *e2 = ieee_exp - 1023 - 52;
+    } else {
+        *e2 = 1 - 1023 - 52;
     }
-    if (p < 0)
-        p = 6;
+    return m;
+#else
+    int e;
+    double m = frexp(y, &e);
+    *e2 = e - DBL_MANT_DIG;
+    return ldexp(m, DBL_MANT_DIG);
+#endif
+}
 
-    if (y)
-        y *= 0x1p28, e2 -= 28;
+// Shortest round-trip conversion of doubles, using the Ryu algorithm:
+//  Ulf Adams. 2018. Ryu: fast float-to-string conversion. PLDI 2018.
+// Each double is mapped to the shortest decimal in its rounding interval
+// (closest to the exact value if there are several) with three 64x128 bit
+// multiplications, instead of an exact bignum expansion.
 
-    if (e2 < 0) {
-        a = r = z = big;
+#include "printf_tables.h"
+
+// Return the low 64 bits of a*b, and the high 64 bits in *hi.
+static inline uint64_t umul128(uint64_t a, uint64_t b, uint64_t *hi)
+{
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 r = (unsigned __int128)a * b;
+    *hi = r >> 64;
+    return r;
+#else
+    uint64_t a_lo = (uint32_t)a, a_hi = a >> 32;
+    uint64_t b_lo = (uint32_t)b, b_hi = b >> 32;
+    uint64_t b00 = a_lo * b_lo, b01 = a_lo * b_hi;
+    uint64_t b10 = a_hi * b_lo, b11 = a_hi * b_hi;
+    uint64_t mid = (b00 >> 32) + (uint32_t)b01 + (uint32_t)b10;
+    *hi = b11 + (b01 >> 32) + (b10 >> 32) + (mid >> 32);
+    return (mid << 32) | (uint32_t)b00;
+#endif
+}
+
+// (m * mul) >> j, where mul is a 128 bit number, and 64 < j < 128.
+static inline uint64_t mul_shift_64(uint64_t m, const uint64_t *mul, int j)
+{
+    uint64_t hi0, hi2;
+    umul128(m, mul[0], &hi0);
+    uint64_t lo2 = umul128(m, mul[1], &hi2);
+    uint64_t lo = lo2 + hi0;
+    uint64_t hi = hi2 + (lo < lo2);
+    j -= 64;
+    return (lo >> j) | (hi << (64 - j));
+}
+
+// floor(log10(2^e)), for 0 <= e <= 1650
+static inline int log10_pow2(int e)
+{
+    return ((uint32_t)e * 78913) >> 18;
+}
+
+// floor(log10(5^e)), for 0 <= e <= 2620
+static inline int log10_pow5(int e)
+{
+    return ((uint32_t)e * 732923) >> 20;
+}
+
+// ceil(log2(5^e)) for 1 <= e <= 3528 (returns 1 for e == 0)
+static inline int pow5_bits(int e)
+{
+    return (((uint32_t)e * 1217359) >> 19) + 1;
+}
+
+static inline bool multiple_of_pow5(uint64_t v, int p)
+{
+    int count = 0;
+    for (; v % 5 == 0; v /= 5)
+        count++;
+    return count >= p;
+}
+
+static inline bool multiple_of_pow2(uint64_t v, int p)
+{
+    return !(v & ((UINT64_C(1) << p) - 1));
+}
+
+// Convert a positive, finite double given by its IEEE representation to the
+// shortest decimal representation that rounds back to it. The result is
+// *digits * 10^exp (return value); *digits has at most 17 decimal digits.
+static int shortest_dec(uint64_t bits, uint64_t *digits)
+{
+    uint64_t ieee_mant = bits & ((UINT64_C(1) << 52) - 1);
+    int ieee_exp = (bits >> 52) & 0x7FF;
+
+    int e2;
+    uint64_t m2;
+    if (ieee_exp == 0) {
+        e2 = 1 - 1023 - 52 - 2;
+        m2 = ieee_mant;
     } else {
-        a = r = z = big + sizeof(big) / sizeof(*big) - LDBL_MANT_DIG - 1;
+        e2 = ieee_exp - 1023 - 52 - 2;
+        m2 = (UINT64_C(1) << 52) | ieee_mant;
     }
-
-    do {
-        *z = y;
-        y = 1000000000 * (y - *z++);
-    } while (y);
-
-    while (e2 > 0) {
-        uint32_t carry = 0;
-        int sh = MIN(29, e2);
-        for (d = z - 1; d >= a; d--) {
-            uint64_t x = ((uint64_t)*d << sh) + carry;
-            *d = x % 1000000000;
-            carry = x / 1000000000;
-        }
-        if (carry)
-            *--a = carry;
-        while (z > a && !z[-1])
-            z--;
-        e2 -= sh;
+    bool accept_bounds = !(m2 & 1);
+
+    // Interval of valid representations is (mv - mm, mv + 2) * 2^e2, where
+    // the lower margin is smaller at the boundaries of an exponent.
+    uint64_t mv = 4 * m2;
+    int mm_shift = ieee_mant != 0 || ieee_exp <= 1;
+
+    // Convert to decimal: vr, vp, vm = mv, mv + 2, mv - 1 - mm_shift scaled by
+    // 2^e2 / 10^e10.
+    uint64_t vr, vp, vm;
+    int e10;
+    bool vm_trailing_zeros = false, vr_trailing_zeros = false;
+    if (e2 >= 0) {
+        int q = log10_pow2(e2) - (e2 > 3);
+        int k = POW5_INV_BITCOUNT + pow5_bits(q) - 1;
+        int i = -e2 + q + k;
+        e10 = q;
+        vr = mul_shift_64(4 * m2, pow5_inv_split[q], i);
+        vp = mul_shift_64(4 * m2 + 2, pow5_inv_split[q], i);
+        vm = mul_shift_64(4 * m2 - 1 - mm_shift, pow5_inv_split[q], i);
+        if (q <= 21) {
+            // Only one of mv, mv + 2 and mv - 1 - mm_shift can be a multiple
+            // of 5, if any.
+            if (mv % 5 == 0) {
+                vr_trailing_zeros = multiple_of_pow5(mv, q);
+            } else if (accept_bounds) {
+                vm_trailing_zeros = multiple_of_pow5(mv - 1 - mm_shift, q);
+            } else {
+                vp -= multiple_of_pow5(mv + 2, q);
+            }
+        }
+    } else {
+        int q = log10_pow5(-e2) - (-e2 > 1);
+        int i = -e2 - q;
+        int k = pow5_bits(i) - POW5_BITCOUNT;
+        int j = q - k;
+        e10 = q + e2;
+        vr = mul_shift_64(4 * m2, pow5_split[i], j);
+        vp = mul_shift_64(4 * m2 + 2, pow5_split[i], j);
+        vm = mul_shift_64(4 * m2 - 1 - mm_shift, pow5_split[i], j);
+        if (q <= 1) {
+            // mv has at least q trailing 0 bits, so vr is exact.
+            vr_trailing_zeros = true;
+            if (accept_bounds) {
+                vm_trailing_zeros = mm_shift == 1;
+            } else {
+                vp--;
+            }
+        } else if (q < 63) {
+            vr_trailing_zeros = multiple_of_pow2(mv, q);
+        }
     }
 
-    while (e2 < 0) {
-        uint32_t carry = 0, *b;
-        int sh = MIN(9, -e2), need = 1 + (p + LDBL_MANT_DIG / 3U + 8) / 9;
-        for (d = a; d < z; d++) {
-            uint32_t rm = *d & ((1 << sh) - 1);
-            *d = (*d >> sh) + carry;
-            carry = (1000000000 >> sh) * rm;
+    // Remove digits as long as the interval still contains a number with
+    // fewer digits.
+    int removed = 0;
+    int last_removed = 0;
+    uint64_t output;
+    if (vm_trailing_zeros || vr_trailing_zeros) {
+        // Rare general case: track whether the removed digits are all 0.
+        while (vp / 10 > vm / 10) {
+            vm_trailing_zeros &= vm % 10 == 0;
+            vr_trailing_zeros &= last_removed == 0;
+            last_removed = vr % 10;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+        if (vm_trailing_zeros) {
+            while (vm % 10 == 0) {
+                vr_trailing_zeros &= last_removed == 0;
+                last_removed = vr % 10;
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+                removed++;
+            }
+        }
+        // Round to even if the exact value is .....50..0.
+        if (vr_trailing_zeros && last_removed == 5 && vr % 2 == 0)
+            last_removed = 4;
+        output = vr + ((vr == vm && (!accept_bounds || !vm_trailing_zeros)) ||
+                       last_removed >= 5);
+    } else {
+        bool round_up = false;
+        if (vp / 100 > vm / 100) {
+            round_up = vr % 100 >= 50;
+            vr /= 100;
+            vp /= 100;
+            vm /= 100;
+            removed += 2;
+        }
+        while (vp / 10 > vm / 10) {
+            round_up = vr % 10 >= 5;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
         }
-        if (!*a)
-            a++;
-        if (carry)
-            *z++ = carry;
-        /* Avoid (slow!) computation past requested precision */
-        b = (t | 32) == 'f' ? r : a;
-        if (z - b > need)
-            z = b + need;
-        e2 += sh;
+        output = vr + (vr == vm || round_up);
     }
 
-    if (a < z) {
-        for (i = 10, e = 9 * (r - a); *a >= i; i *= 10, e++) {
-        }
+    *digits = output;
+    return e10 + removed;
+}
+
+// %v: shortest digit string that round-trips. The notation is chosen like
+// "%.17g" would (17 being enough digits for any double to round-trip), but
+// trailing zeros are never printed.
+static int fmt_shortest(struct buf *f, const char *prefix, int pl, double y,
+                        int w, int fl, int t)
+{
+    char buf[20];
+    uint64_t bits;
+    int nd = 1, x = 0;
+
+    memcpy(&bits, &y, sizeof(bits));
+    bits &= ~(UINT64_C(1) << 63);
+
+    if (bits) {
+        uint64_t digits;
+        int e10 = shortest_dec(bits, &digits);
+        char *s = fmt_u64(digits, buf + sizeof(buf));
+        nd = buf + sizeof(buf) - s;
+        memmove(buf, s, nd);
+        x = e10 + nd - 1;
     } else {
-        e = 0;
+        buf[0] = '0';
     }
 
-    /* Perform rounding: j is precision after the radix (possibly neg) */
-    j = p - ((t | 32) != 'f') * e - ((t | 32) == 'g' && p);
-    if (j < 9 * (z - r - 1)) {
-        uint32_t x;
-        /* We avoid C's broken division of negative numbers */
-        d = r + 1 + ((j + 9 * LDBL_MAX_EXP) / 9 - LDBL_MAX_EXP);
-        j += 9 * LDBL_MAX_EXP;
-        j %= 9;
-        for (i = 10, j++; j < 9; i *= 10, j++) {
+    if (x >= -4 && x < 17)
+        return fmt_dec(f, prefix, pl, buf, nd, x, w, MAX(nd - x - 1, 0), fl,
+                       (t & 32) ? 'f' : 'F');
+    return fmt_dec(f, prefix, pl, buf, nd, x, w, nd - 1, fl,
+                   (t & 32) ? 'e' : 'E');
+}
+
+// Fixed precision conversion of doubles with up to FIXED_MAX_PREC digits. The
+// value m*2^e2 is scaled by a power of 10 with exact 64/128 bit integer
+// arithmetic, which covers the common magnitudes; everything else falls back
+// to the bignum code in fmt_fp(). Rounding is to nearest, ties to even (like
+// the bignum code in the default rounding mode).
+#define FIXED_MAX_PREC 17
+
+static const uint64_t pow5_64[28] = {
+    UINT64_C(1), UINT64_C(5), UINT64_C(25), UINT64_C(125),
+    UINT64_C(625), UINT64_C(3125), UINT64_C(15625), UINT64_C(78125),
+    UINT64_C(390625), UINT64_C(1953125), UINT64_C(9765625), UINT64_C(48828125),
+    UINT64_C(244140625), UINT64_C(1220703125), UINT64_C(6103515625), UINT64_C(30517578125),
+    UINT64_C(152587890625), UINT64_C(762939453125), UINT64_C(3814697265625), UINT64_C(19073486328125),
+    UINT64_C(95367431640625), UINT64_C(476837158203125), UINT64_C(2384185791015625), UINT64_C(11920928955078125),
+    UINT64_C(59604644775390625), UINT64_C(298023223876953125), UINT64_C(1490116119384765625), UINT64_C(7450580596923828125),
+};
+
+// Compute floor(m * 2^e2 * 10^s) into *q (0 <= m < 2^64, |s| < 28). Return how
+// the discarded fraction compares to 1/2: 0 if it is 0, 1 if less, 2 if
+// equal, 3 if greater. Return -1 if this can't be done with 128 bit integers,
+// or if the result doesn't fit into 64 bits.
+static int scale_dec(uint64_t m, int e2, int s, uint64_t *q)
+{
+    if (s >= 0) {
+        uint64_t hi, lo = umul128(m, pow5_64[s], &hi);
+        int sh = e2 + s;
+        if (sh >= 0) {
+            if (hi || sh >= 64 || lo >> (63 - sh) > 1)
+                return -1;
+            *q = lo << sh;
+            return 0;
         }
-        x = *d % i;
-        /* Are there any significant digits past j? */
-        if (x || d + 1 != z) {
-            long double round = 2 / LDBL_EPSILON;
-            long double small;
-            if ((*d / i & 1) || (i == 1000000000 && d > a && (d[-1] & 1)))
-                round += 2;
-            if (x < i / 2) {
-                small = 0x0.8p0;
-            } else if (x == i / 2 && d + 1 == z) {
-                small = 0x1.0p0;
+        sh = -sh;
+        if (sh >= 128) {
+            // (m * 5^s < 2^127)
+            *q = 0;
+            return lo || hi ? 1 : 0;
+        }
+        uint64_t rhi, rlo, half_hi = 0, half_lo = 0;
+        if (sh >= 64) {
+            *q = hi >> (sh - 64);
+            rhi = sh == 64 ? 0 : hi & ((UINT64_C(1) << (sh - 64)) - 1);
+            rlo = lo;
+            if (sh == 64) {
+                half_lo = UINT64_C(1) << 63;
             } else {
-                small = 0x1.8p0;
+                half_hi = UINT64_C(1) << (sh - 65);
             }
-            if (pl && *prefix == '-')
-                round *= -1, small *= -1;
-            *d -= x;
-            /* Decide whether to round by probing round+small */
-            if (round + small != round) {
-                *d = *d + i;
-                while (*d > 999999999) {
-                    *d-- = 0;
-                    if (d < a)
-                        *--a = 0;
-                    (*d)++;
-                }
-                for (i = 10, e = 9 * (r - a); *a >= i; i *= 10, e++) {
-                }
+        } else {
+            if (hi >> sh)
+                return -1;
+            *q = (lo >> sh) | (sh ? hi << (64 - sh) : 0);
+            rhi = 0;
+            rlo = sh ? lo & ((UINT64_C(1) << sh) - 1) : 0;
+            if (sh)
+                half_lo = UINT64_C(1) << (sh - 1);
+        }
+        if (!rhi && !rlo)
+            return 0;
+        if (rhi != half_hi)
+            return rhi < half_hi ? 1 : 3;
+        if (rlo != half_lo)
+            return rlo < half_lo ? 1 : 3;
+        return 2;
+    } else {
+        // m * 2^e2 / (5^-s * 2^-s)
+        uint64_t n = m, d = pow5_64[-s];
+        int sh = e2 + s;
+        if (sh >= 0) {
+            if (sh >= 64 || n >> (63 - sh) > 1)
+                return -1;
+            n <<= sh;
+        } else {
+            if (-sh >= 64 || d >> (63 + sh))
+                return -1;
+            d <<= -sh;
+        }
+        uint64_t r = n % d;
+        *q = n / d;
+        // (d < 2^63, so 2 * r can't overflow)
+        if (!r)
+            return 0;
+        return 2 * r < d ? 1 : 2 * r == d ? 2 : 3;
+    }
+}
+
+// Round y to p digits after the radix point (fixed==true), or to p + 1
+// significant digits (fixed==false). The resulting digits are written to buf
+// (which must have space for 20 digits), see fmt_dec() for the meaning of *nd
+// and *x. Return false if the fast path can't be used.
+static bool fixed_dec(double y, int p, bool fixed, char *buf, int *nd, int *x)
+{
+    uint64_t m, q;
+    int e2, e10, r;
+
+    m = dbl_mantissa(y, &e2);
+
+    if (!m) {
+        buf[0] = '0';
+        *nd = 1;
+        *x = 0;
+        return true;
+    }
+
+    if (fixed) {
+        e10 = 0;
+        r = scale_dec(m, e2, p, &q);
+        if (r < 0)
+            return false;
+    } else {
+        // Estimate the decimal exponent of the first digit from the position
+        // of the highest bit, then correct it if it's off by one.
+        int b = e2;
+        for (uint64_t t = m >> 1; t; t >>= 1)
+            b++;
+        e10 = b >= 0 ? log10_pow2(b) : -log10_pow2(-b) - 1;
+        uint64_t lo = pow5_64[p] << p, hi = lo * 10; // 10^p, 10^(p+1)
+        for (int n = 0; ; n++) {
+            if (p - e10 < -27 || p - e10 > 27 || n > 2)
+                return false;
+            r = scale_dec(m, e2, p - e10, &q);
+            if (r < 0)
+                return false;
+            if (q >= hi) {
+                e10++;
+            } else if (q < lo) {
+                e10--;
+            } else {
+                break;
             }
         }
-        if (z > d + 1)
-            z = d + 1;
+        e10 = -e10;
     }
-    for (; z > a && !z[-1]; z--) {
+
+    q += r == 3 || (r == 2 && (q & 1));
+
+    char *s = fmt_u64(q, buf + 20);
+    int n = buf + 20 - s;
+    if (!n)
+        *--s = '0', n = 1;
+    memmove(buf, s, n);
+
+    if (!fixed && n > p + 1) {
+        // Rounding carried into a new digit (10^(p+1) => 1.000e+1).
+        n = p + 1;
+        e10--;
+    }
+
+    *nd = n;
+    *x = n - 1 - p - e10;
+    return true;
+}
+
+// Return floor(log10(y)) for a finite y > 0, or INT_MIN if y is too close to
+// a power of 10 to decide this cheaply.
+static int dec_exponent(double y)
+{
+    uint64_t bits, digits;
+    memcpy(&bits, &y, sizeof(bits));
+    int e10 = shortest_dec(bits, &digits);
+    while (digits % 10 == 0) {
+        digits /= 10;
+        e10++;
+    }
+    int x = e10 + count_digits(digits, 10) - 1;
+    // The shortest representation is in the rounding interval of y, so it can
+    // only be on the other side of a power of 10 if it is that power of 10.
+    if (digits == 1) {
+        if (x < 0 || x > 19)
+            return INT_MIN;
+        if (y < (double)pow10_64[x])
+            x--;
+    }
+    return x;
+}
+
+// Return the length of the %f/%e/%g conversion of y (without sign and
+// padding), if it can be computed without generating the digits; else -1.
+// This is the case for at least 18 significant digits, or 18 digits after the
+// radix point: a double can't be close enough to a power of 10 for rounding to
+// carry into a new leading digit, so the length follows from the decimal
+// exponent of y. ("%g" without '#' depends on the trailing zeros, though.)
+static int64_t fp_len(double y, int p, int fl, int t)
+{
+    int x = 0;
+
+    if (p < 18 || ((t | 32) == 'g' && !(fl & FLAGS_HASH)))
+        return -1;
+
+    if (y && ((t | 32) != 'f' || y >= 1)) {
+        x = dec_exponent(y);
+        if (x == INT_MIN)
+            return -1;
     }
 
     if ((t | 32) == 'g') {
-        if (!p)
-            p++;
-        if (p > e && e >= -4) {
+        if (p > x && x >= -4) {
             t--;
-            p -= e + 1;
+            p -= x + 1;
         } else {
             t -= 2;
             p--;
         }
-        if (!(fl & FLAGS_HASH)) {
-            /* Count trailing zeros in last place */
-            if (z > a && z[-1]) {
-                for (i = 10, j = 0; z[-1] % i == 0; i *= 10, j++);
-            } else {
-                j = 9;
-            }
-            if ((t | 32) == 'f') {
-                p = MIN(p, MAX(0, 9 * (z - r - 1) - j));
-            } else {
-                p = MIN(p, MAX(0, 9 * (z - r - 1) + e - j));
-            }
-        }
     }
-    if (p > INT_MAX - 1 - (p || (fl & FLAGS_HASH)))
-        return -1;
-    l = 1 + p + (p || (fl & FLAGS_HASH));
+
+    int64_t l = 1 + (int64_t)p + (p || (fl & FLAGS_HASH));
     if ((t | 32) == 'f') {
-        if (e > INT_MAX - l)
-            return -1;
-        if (e > 0)
-            l += e;
+        if (x > 0)
+            l += x;
     } else {
-        estr = fmt_u(e < 0 ? -e : e, ebuf);
-        while (ebuf - estr < 2)
-            *--estr = '0';
-        *--estr = (e < 0 ? '-' : '+');
-        *--estr = t;
-        if (ebuf - estr > INT_MAX - l)
-            return -1;
-        l += ebuf - estr;
+        l += 2 + (x <= -100 || x >= 100 ? 3 : 2);
     }
+    return l;
+}
 
-    if (l > INT_MAX - pl)
-        return -1;
-    pad(f, ' ', w, pl + l, fl);
-    out(f, prefix, pl);
-    pad(f, '0', w, pl + l, fl ^ FLAGS_ZEROPAD);
+// The bignum code below works on base 10^9 limbs, most significant first.
+// Scaling by 2^e is split into a table entry for a multiple of BIG_POW_STEP,
+// and a rest applied with scalar passes over the (then still small) bignum.
+_Static_assert(BIG_POW_STEP % 9 == 0, "");
+_Static_assert((DBL_MAX_EXP - 1) / BIG_POW_STEP <
+               sizeof(big_pow2_idx) / sizeof(big_pow2_idx[0]) - 1, "");
+_Static_assert((DBL_MANT_DIG - DBL_MIN_EXP) / BIG_POW_STEP <
+               sizeof(big_pow5_idx) / sizeof(big_pow5_idx[0]) - 1, "");
+_Static_assert(DBL_MANT_DIG <= 64, "");
+
+// Multiply the bignum a..z by k (k <= 2^34), prepending limbs to a for the
+// carry. Returns the new a.
+static uint32_t *big_scale(uint32_t *a, uint32_t *z, uint64_t k)
+{
+    uint64_t carry = 0;
+    for (uint32_t *d = z - 1; d >= a; d--) {
+        uint64_t x = *d * k + carry;
+        *d = x % 1000000000;
+        carry = x / 1000000000;
+    }
+    for (; carry; carry /= 1000000000)
+        *--a = carry % 1000000000;
+    return a;
+}
+
+// Divide the bignum a..z by 2^sh (sh <= 9), where z - 1 is the last limb after
+// the radix point. Appends a limb for the remainder. Returns the new z.
+static uint32_t *big_shr(uint32_t *a, uint32_t *z, int sh)
+{
+    uint32_t carry = 0;
+    for (uint32_t *d = a; d < z; d++) {
+        uint32_t rm = *d & ((1 << sh) - 1);
+        *d = (*d >> sh) + carry;
+        carry = (1000000000 >> sh) * rm;
+    }
+    if (carry)
+        *z++ = carry;
+    return z;
+}
+
+// Set res[0 .. xn + yn - 1] to x * y. res must be zeroed. Only the limbs
+// before res[cut] are computed, leaving out the partial products below; this
+// makes the result smaller by less than xn units of res[cut - 2].
+static void big_mul(uint32_t *res, const uint32_t *x, int xn,
+                    const uint32_t *y, int yn, int cut)
+{
+    for (int i = MIN(xn - 1, cut - 2); i >= 0; i--) {
+        uint64_t carry = 0;
+        for (int j = MIN(yn - 1, cut - 2 - i); j >= 0; j--) {
+            // (< 10^9 + (10^9 - 1)^2 + 10^9, so no overflow)
+            uint64_t t = res[i + j + 1] + (uint64_t)x[i] * y[j] + carry;
+            res[i + j + 1] = t % 1000000000;
+            carry = t / 1000000000;
+        }
+        res[i] = carry;
+    }
+}
+
+// Output the digits of the bignum a..z (integer part ending at r) for
+// fmt_fp(), p digits after the radix point. Returns early once the output is
+// dropped or the stop mark is reached.
+static void fp_digits(struct buf *f, uint32_t *a, uint32_t *r, uint32_t *z,
+                      int p, int fl, int t, const char *estr, int el)
+{
+    char buf[9];
+    uint32_t *d;
 
     if ((t | 32) == 'f') {
         if (a > r)
             a = r;
         for (d = a; d <= r; d++) {
+            if (out_discard(f) || out_stop(f))
+                return;
             char *s = fmt_u(*d, buf + 9);
             if (d != a) {
                 while (s > buf)
@@ -502,16 +1223,21 @@ static int fmt_fp(struct buf *f, long double y, int w, int p, int fl, int t)
         if (p || (fl & FLAGS_HASH))
             out(f, ".", 1);
         for (; d < z && p > 0; d++, p -= 9) {
+            if (out_discard(f) || out_stop(f))
+                return;
             char *s = fmt_u(*d, buf + 9);
             while (s > buf)
                 *--s = '0';
             out(f, s, MIN(9, p));
         }
-        pad(f, '0', p + 9, 9, 0);
+        if (p > 0)
+            out_pad(f, '0', p);
     } else {
         if (z <= a)
             z = a + 1;
         for (d = a; d < z && p >= 0; d++) {
+            if (out_discard(f) || out_stop(f))
+                return;
             char *s = fmt_u(*d, buf + 9);
             if (s == buf + 9)
                 *--s = '0';
@@ -526,285 +1252,1236 @@ static int fmt_fp(struct buf *f, long double y, int w, int p, int fl, int t)
             out(f, s, MIN(buf + 9 - s, p));
             p -= buf + 9 - s;
         }
-        pad(f, '0', p + 18, 18, 0);
-        out(f, estr, ebuf - estr);
+        if (p > 0)
+            out_pad(f, '0', p);
+        out(f, estr, el);
     }
-
-    pad(f, ' ', w, pl + l, fl ^ FLAGS_LEFT);
-
-    return MAX(w, pl + l);
 }
 
-// internal vsnprintf
-static int vsnprintf_(struct buf *buffer, const char *format, va_list va)
+static int fmt_fp(struct buf *f, double y, int w, int p, int fl, int t)
 {
-    int err = 0;
+    // (fraction limbs for the smallest subnormal, up to 4 integer limbs, and
+    // 2 spare limbs)
+    uint32_t big[(DBL_MANT_DIG - DBL_MIN_EXP + 8) / 9 + 6];
+    uint32_t *a, *d, *r, *z;
+    int e2 = 0, e, i, j, l;
+    char buf[9 + DBL_MANT_DIG / 4], *s;
+    const char *prefix = "-0X+0X 0X-0x+0x 0x";
+    int pl;
+    char ebuf0[3 * sizeof(int)], *ebuf = &ebuf0[3 * sizeof(int)], *estr = ebuf;
 
-    while (*format) {
-        const char *format_start = format;
+    pl = 1;
+    if (signbit(y)) {
+        y = -y;
+    } else if (fl & FLAGS_PLUS) {
+        prefix += 3;
+    } else if (fl & FLAGS_SPACE) {
+        prefix += 6;
+    } else {
+        prefix++, pl = 0;
+    }
 
-        // format specifier?  %[flags][width][.precision][length]
-        if (*format != '%') {
-            outc(buffer, *format++);
-            continue;
-        }
+    if (!isfinite(y)) {
+        HOOK_FP(f, LIN_FP_SPECIAL);
+        char *s = (t & 32) ? "inf" : "INF";
+        if (y != y)
+            s = (t & 32) ? "nan" : "NAN";
+        pad(f, ' ', w, 3 + pl, fl & ~FLAGS_ZEROPAD);
+        out(f, prefix, pl);
+        out(f, s, 3);
+        pad(f, ' ', w, 3 + pl, fl ^ FLAGS_LEFT);
+        return MAX(w, 3 + pl);
+    }
 
-        format++;
+    if ((t | 32) == 'v') {
+#if DBL_IEEE754
+        HOOK_FP(f, LIN_FP_SHORTEST);
+        return fmt_shortest(f, prefix, pl, y, w, fl, t);
+#else
+        t += 'g' - 'v';
+        p = 17;
+#endif
+    }
 
-        // evaluate flags
-        unsigned int flags = 0U;
-        while (1) {
-            bool done = false;
-            switch (*format) {
-            case '0':
-                flags |= FLAGS_ZEROPAD;
-                break;
-            case '-':
-                flags |= FLAGS_LEFT;
-                break;
-            case '+':
-                flags |= FLAGS_PLUS;
-                break;
-            case ' ':
-                flags |= FLAGS_SPACE;
-                break;
-            case '#':
-                flags |= FLAGS_HASH;
-                break;
-            default:
-                done = true;
-                break;
+#if DBL_IEEE754
+    // Fast path for the common precisions.
+    if ((t | 32) != 'a' && p <= FIXED_MAX_PREC) {
+        char dbuf[20];
+        int nd, x, dp = p < 0 ? 6 : p;
+        bool g = (t | 32) == 'g';
+        if (fixed_dec(y, g ? MAX(dp, 1) - 1 : dp, (t | 32) == 'f',
+                      dbuf, &nd, &x))
+        {
+            HOOK_FP(f, LIN_FP_FIXED);
+            p = dp;
+            if (g) {
+                // Same logic as with the bignum code below.
+                if (!p)
+                    p++;
+                if (p > x && x >= -4) {
+                    t--;
+                    p -= x + 1;
+                } else {
+                    t -= 2;
+                    p--;
+                }
+                if (!(fl & FLAGS_HASH)) {
+                    while (nd > 1 && dbuf[nd - 1] == '0')
+                        nd--;
+                    p = MIN(p, MAX(0, (t | 32) == 'f' ? nd - x - 1 : nd - 1));
+                }
             }
-            if (done)
-                break;
-            format++;
+            return fmt_dec(f, prefix, pl, dbuf, nd, x, w, p, fl, t);
         }
+    }
 
-        // evaluate width field
-        int width = 0;
-        if (*format == '*') {
-            width = va_arg(va, int);
-            if (width < 0) {
-                flags |= FLAGS_LEFT; // reverse padding
-                width = width == INT_MIN ? INT_MAX : -width;
-            }
-            format++;
-        } else {
-            width = fmt_atoi(&format);
+    // If the output is dropped anyway, try to avoid the bignum expansion.
+    if ((t | 32) != 'a' && (out_discard(f) || out_stop(f))) {
+        int64_t l = fp_len(y, p, fl, t);
+        if (l >= 0) {
+            if (l > INT_MAX - pl)
+                return -1;
+            HOOK_FP(f, LIN_FP_LENGTH);
+            HOOK_PAD(f, MAX(0, w - (pl + (int)l)));
+            out_skip(f, MAX(w, pl + (int)l));
+            return MAX(w, pl + (int)l);
         }
+    }
+#endif
 
-        // evaluate precision field
-        int precision = -1;
-        if (*format == '.') {
-            format++;
-            if (*format == '*') {
-                precision = va_arg(va, int);
-                format++;
-            } else {
-                precision = fmt_atoi(&format);
-            }
+    if ((t | 32) == 'a') {
+        HOOK_FP(f, LIN_FP_HEX);
+
+        // Number of hex digits after the radix point for the full mantissa.
+        enum { XD = (DBL_MANT_DIG + 2) / 4 };
+        _Static_assert(4 * XD + 1 < 64, "");
+
+        // Normalize to m = 1.xxx * 2^(4*XD), so that the fraction digits are
+        // the nibbles of m below bit 4*XD.
+        uint64_t m = dbl_mantissa(y, &e2);
+        if (m) {
+            int sh = DBL_MANT_DIG - bit_length(m);
+            m <<= sh + 4 * XD - (DBL_MANT_DIG - 1);
+            e2 += DBL_MANT_DIG - 1 - sh;
+        } else {
+            e2 = 0;
         }
 
-        // "A - overrides a 0 if both are given."
-        if (flags & FLAGS_LEFT)
-            flags &= ~FLAGS_ZEROPAD;
+        if (t & 32)
+            prefix += 9;
+        pl += 2;
 
-        // evaluate length field
-        int type = TYPE_NONE;
-        switch (*format) {
-        case 'l':
-            type = TYPE_LONG;
-            format++;
-            if (*format == 'l') {
-                type = TYPE_LLONG;
-                format++;
-            }
-            break;
-        case 'h':
-            type = TYPE_SHORT;
-            format++;
-            if (*format == 'h') {
-                type = TYPE_CHAR;
-                format++;
-            }
-            break;
-        case 't':
-        case 'z':
-            type = TYPE_SIZE; // assumption that size_t == unsigned ptrdiff_t
-            format++;
-            break;
-        case 'j': ;
-            type = TYPE_INTMAX;
-            format++;
-            break;
-        case 'I':
-            if (format[1] == '6' && format[2] == '4') {
-                type = TYPE_I64;
-                format += 3;
-            } else if (format[1] == '3' && format[2] == '2') {
-                type = TYPE_I32;
-                format += 3;
-            } else if (format[1] == '1' && format[2] == '6') {
-                type = TYPE_SHORT;
-                format += 3;
-            } else if (format[1] == '8') {
-                type = TYPE_CHAR;
-                format += 2;
-            } else if (!(format[1] >= '0' && format[1] <= '9')) {
-                type = TYPE_SIZE; // MS extension for ptrdiff_t and size_t
-                format += 1;
-            }
-            break;
-        default:
-            break;
+        // Round to p hex digits after the radix point (to nearest, ties to
+        // even). This can carry into the leading digit, making it 2.
+        if (p >= 0 && p < XD) {
+            int drop = 4 * (XD - p);
+            uint64_t rem = m & ((UINT64_C(1) << drop) - 1);
+            uint64_t half = UINT64_C(1) << (drop - 1);
+            m -= rem;
+            if (rem > half || (rem == half && ((m >> drop) & 1)))
+                m += UINT64_C(1) << drop;
         }
 
-        // evaluate specifier
-        char fmt = *format++;
-        switch (fmt) {
-        case 'd':
-        case 'i':
-        case 'u':
-        case 'x':
-        case 'X':
-        case 'p':
-        case 'o':
-        case 'b': {
-            // set the base
-            unsigned int base = 10U;
-            if (fmt == 'x' || fmt == 'X' || fmt == 'p')
-                base = 16U;
-            else if (fmt == 'o')
-                base =  8U;
-            else if (fmt == 'b') {
-                base =  2U;
-            }
+        estr = fmt_u(e2 < 0 ? -e2 : e2, ebuf);
+        if (estr == ebuf)
+            *--estr = '0';
+        *--estr = (e2 < 0 ? '-' : '+');
+        *--estr = t + ('p' - 'a');
 
-            // uppercase
-            if (fmt == 'X')
-                flags |= FLAGS_UPPERCASE;
+        uint64_t frac = m & ((UINT64_C(1) << 4 * XD) - 1);
+        s = buf;
+        *s++ = xdigits[m >> 4 * XD] | (t & 32);
+        if (frac || p > 0 || (fl & FLAGS_HASH))
+            *s++ = '.';
+        for (int sh = 4 * XD; frac; ) {
+            sh -= 4;
+            *s++ = xdigits[frac >> sh] | (t & 32);
+            frac &= (UINT64_C(1) << sh) - 1;
+        }
 
-            if (fmt == 'p') {
-                flags |= FLAGS_HASH;
-                type = TYPE_PTR;
-            }
+        if (p > INT_MAX - 2 - (ebuf - estr) - pl)
+            return -1;
+        if (p && s - buf - 2 < p)
+            l = (p + 2) + (ebuf - estr);
+        else
+            l = (s - buf) + (ebuf - estr);
 
-            // if a precision is specified, the 0 flag is ignored
-            if (precision >= 0)
-                flags &= ~FLAGS_ZEROPAD;
+        pad(f, ' ', w, pl + l, fl);
+        out(f, prefix, pl);
+        pad(f, '0', w, pl + l, fl ^ FLAGS_ZEROPAD);
+        out(f, buf, s - buf);
+        if (l - (ebuf - estr) - (s - buf) > 0)
+            out_pad(f, '0', l - (ebuf - estr) - (s - buf));
+        out(f, estr, ebuf - estr);
+        pad(f, ' ', w, pl + l, fl ^ FLAGS_LEFT);
+        return MAX(w, pl + l);
+    }
+    if (p < 0)
+        p = 6;
 
-            // convert the integer
-            if (fmt == 'i' || fmt == 'd') {
-                // signed
-                intmax_t val;
-                switch (type) {
-                case TYPE_NONE:     val = va_arg(va, int);              break;
-                case TYPE_I32:      val = va_arg(va, int32_t);          break;
-                case TYPE_CHAR:     val = (signed char)va_arg(va, int); break;
-                case TYPE_SHORT:    val = (short)va_arg(va, int);       break;
-                case TYPE_LONG:     val = va_arg(va, long);             break;
-                case TYPE_I64:      val = va_arg(va, int64_t);          break;
-                case TYPE_LLONG:    val = va_arg(va, long long);        break;
-                case TYPE_INTMAX:   val = va_arg(va, intmax_t);         break;
-                case TYPE_SIZE:     val = va_arg(va, ptrdiff_t);        break;
-                default: assert(0);
-                }
-                ntoa_format(buffer, val < 0 ? -(uintmax_t)val : val, val < 0,
-                            base, precision, width, flags);
-            } else {
-                // unsigned
-                uintmax_t val;
-                switch (type) {
-                case TYPE_NONE:     val = va_arg(va, unsigned);                 break;
-                case TYPE_I32:      val = va_arg(va, uint32_t);                 break;
-                case TYPE_CHAR:     val = (unsigned char)va_arg(va, unsigned);  break;
-                case TYPE_SHORT:    val = (unsigned short)va_arg(va, unsigned); break;
-                case TYPE_LONG:     val = va_arg(va, unsigned long);            break;
-                case TYPE_I64:      val = va_arg(va, uint64_t);                 break;
-                case TYPE_LLONG:    val = va_arg(va, unsigned long long);       break;
-                case TYPE_INTMAX:   val = va_arg(va, uintmax_t);                break;
-                case TYPE_SIZE:     val = va_arg(va, size_t);                   break;
-                case TYPE_PTR:      val = (uintptr_t)va_arg(va, void *);        break;
-                default: assert(0);
-                }
-                flags &= ~(FLAGS_PLUS | FLAGS_SPACE);
-                ntoa_format(buffer, val, false, base, precision, width, flags);
-            }
-            break;
-        }
-        case 'f':
-        case 'F':
-        case 'g':
-        case 'G':
-        case 'e':
-        case 'E':
-        case 'a':
-        case 'A': {
-            if (fmt_fp(buffer, va_arg(va, double), width, precision, flags, fmt) < 0)
-                out(buffer, "<error>", 7);
-            break;
-        }
-        case 'c': {
-            // pre padding
-            if (!(flags & FLAGS_LEFT) && width > 1)
-                out_pad(buffer, ' ', width - 1);
-            // char output
-            outc(buffer, (char)va_arg(va, int));
-            // post padding
-            if ((flags & FLAGS_LEFT) && width > 1)
-                out_pad(buffer, ' ', width - 1);
-            break;
-        }
+    HOOK_FP(f, LIN_FP_BIGNUM);
+
+    // Expand y == m * 2^e2 exactly. With e2 == s - BIG_POW_STEP * k for
+    // s >= 0 (and e2 < 0), this is (m / 2^s) * 5^(BIG_POW_STEP * k) shifted
+    // by BIG_POW_STEP * k decimal digits: a few passes over the small m, and
+    // a single multiplication with a table entry, instead of a pass over the
+    // whole bignum for each 29 (or 9) bits of exponent. The same for e2 > 0.
+    uint32_t x[12], *xa, *xz; // (m limbs, and up to 9 fraction limbs)
+    uint64_t m = dbl_mantissa(y, &e2);
+    if (m) {
+        // (Trailing zero bits would only make the powers larger.)
+        int tz = bit_length(m & -m) - 1;
+        m >>= tz;
+        e2 += tz;
+    } else {
+        e2 = 0;
+    }
+    int n = e2 < 0 ? -e2 : e2, frac = 0, rest = n % BIG_POW_STEP;
+
+    // Start with m / 2^s0 (for e2 < 0), the integer part followed by the
+    // fraction limbs (s0 <= 34, so that the fraction bits times 10^9 fit).
+    int s0 = e2 < 0 ? MIN(rest, 34) : 0;
+    uint64_t mf = m & ((UINT64_C(1) << s0) - 1);
+    xa = xz = e2 < 0 ? x + 2 : x + 12;
+    m >>= s0;
+    do {
+        *--xa = m % 1000000000;
+        m /= 1000000000;
+    } while (m);
+    while (mf) {
+        mf *= 1000000000;
+        *xz++ = mf >> s0;
+        mf &= (UINT64_C(1) << s0) - 1;
+    }
 
-        case 's': {
-            char *p = va_arg(va, char *);
-            size_t l = strlen(p);
-            if (precision >= 0)
-                l = l < precision ? l : precision;
-            // pre padding
-            if (!(flags & FLAGS_LEFT) && width > l)
-                out_pad(buffer, ' ', width - l);
-            // string output
-            out(buffer, p, l);
-            // post padding
-            if ((flags & FLAGS_LEFT) && width > l)
-                out_pad(buffer, ' ', width - l);
-            break;
+    for (rest -= s0; rest > 0; ) {
+        int sh = MIN(rest, e2 < 0 ? 9 : 34);
+        HOOK_BIGNUM(f);
+        if (e2 < 0) {
+            xz = big_shr(xa, xz, sh);
+        } else {
+            xa = big_scale(xa, xz, UINT64_C(1) << sh);
         }
+        rest -= sh;
+    }
+    if (e2 < 0) {
+        frac = xz - (x + 2) + n / BIG_POW_STEP * (BIG_POW_STEP / 9);
+        while (xa < xz - 1 && !*xa)
+            xa++;
+    }
 
-        case 'r': {
-            const char *format_r = va_arg(va, char *);
-            struct lin_va_list args_r = va_arg(va, struct lin_va_list);
-            int rerr = 0;
-            va_list va_r;
-            va_copy(va_r, *args_r.ap);
-            rerr = vsnprintf_(buffer, format_r, va_r);
-            va_end(va_r);
-            if (!err)
-                err = rerr;
-            break;
+    const uint32_t *pw = e2 < 0 ? big_pow5 : big_pow2;
+    const uint16_t *pw_idx = e2 < 0 ? big_pow5_idx : big_pow2_idx;
+    int k = n / BIG_POW_STEP;
+    int xn = xz - xa, yn = pw_idx[k + 1] - pw_idx[k];
+
+    // Limb big[0] is spare for a rounding carry, the integer part ends at r,
+    // followed by the fraction limbs. *z is zeroed as well (for y == 0).
+    int xyn = xn + yn, cut = xyn;
+    r = big + MAX(xyn - frac, 1);
+    z = r + 1 + frac;
+    assert(z < big + sizeof(big) / sizeof(big[0]));
+    uint32_t *res = z - xyn;
+    if (e2 < 0 && k) {
+        // Avoid computing limbs past the requested precision (the leading
+        // limb of the product is res[0] or res[1]). The limbs left out can't
+        // all be 0, because the last limb isn't (for odd m, it ends with 5).
+        int need = 1 + (p + DBL_MANT_DIG / 3U + 8) / 9;
+        ptrdiff_t b = (t | 32) == 'f' ? r - res : 1;
+        cut = MIN(cut, MAX(b + need, 0) + 2);
+    }
+    memset(big, 0, (res + cut + 1 - big) * sizeof(big[0]));
+    if (k) {
+        HOOK_BIGNUM(f);
+        big_mul(res, xa, xn, pw + pw_idx[k], yn, cut);
+    } else {
+        memcpy(res + 1, xa, xn * sizeof(*xa)); // (times 1)
+    }
+    if (cut < xyn) {
+        // The limbs before res[cut - 2] are exact, unless the error can
+        // carry into them; then compute everything.
+        if (res[cut - 2] < 999999999 - xn) {
+            z = res + cut - 2;
+        } else {
+            memset(res, 0, (xyn + 1) * sizeof(big[0]));
+            big_mul(res, xa, xn, pw + pw_idx[k], yn, xyn);
+            cut = xyn;
         }
+    }
+    for (a = big + 1; a < z && !*a; a++) {
+    }
+    if (cut == xyn) {
+        while (z > a && !z[-1])
+            z--;
+    }
 
-        case '%':
-            outc(buffer, '%');
-            break;
-
-        default:
-            out(buffer, format_start, format - format_start);
-            out(buffer, "<error>", 7);
-            err = -1;
-            break;
+    if (a < z) {
+        for (i = 10, e = 9 * (r - a); *a >= i; i *= 10, e++) {
         }
+    } else {
+        e = 0;
     }
 
+    /* Perform rounding: j is precision after the radix (possibly neg) */
+    j = p - ((t | 32) != 'f') * e - ((t | 32) == 'g' && p);
+    if (j < 9 * (z - r - 1)) {
+        uint32_t x;
+        /* We avoid C's broken division of negative numbers */
+        d = r + 1 + ((j + 9 * DBL_MAX_EXP) / 9 - DBL_MAX_EXP);
+        j += 9 * DBL_MAX_EXP;
+        j %= 9;
+        for (i = 10, j++; j < 9; i *= 10, j++) {
+        }
+        x = *d % i;
+        /* Are there any significant digits past j? */
+        if (x || d + 1 != z) {
+            double round = 2 / DBL_EPSILON;
+            double small, probe;
+            if ((*d / i & 1) || (i == 1000000000 && d > a && (d[-1] & 1)))
+                round += 2;
+            if (x < i / 2) {
+                small = 0x0.8p0;
+            } else if (x == i / 2 && d + 1 == z) {
+                small = 0x1.0p0;
+            } else {
+                small = 0x1.8p0;
+            }
+            if (pl && *prefix == '-')
+                round *= -1, small *= -1;
+            *d -= x;
+            /* Decide whether to round by probing round+small */
+            /* (The assignment drops excess precision, see FLT_EVAL_METHOD.) */
+            probe = round + small;
+            if (probe != round) {
+                *d = *d + i;
+                while (*d > 999999999) {
+                    *d-- = 0;
+                    if (d < a)
+                        *--a = 0;
+                    (*d)++;
+                }
+                for (i = 10, e = 9 * (r - a); *a >= i; i *= 10, e++) {
+                }
+            }
+        }
+        if (z > d + 1)
+            z = d + 1;
+    }
+    for (; z > a && !z[-1]; z--) {
+    }
+
+    if ((t | 32) == 'g') {
+        if (!p)
+            p++;
+        if (p > e && e >= -4) {
+            t--;
+            p -= e + 1;
+        } else {
+            t -= 2;
+            p--;
+        }
+        if (!(fl & FLAGS_HASH)) {
+            /* Count trailing zeros in last place */
+            if (z > a && z[-1]) {
+                for (i = 10, j = 0; z[-1] % i == 0; i *= 10, j++);
+            } else {
+                j = 9;
+            }
+            if ((t | 32) == 'f') {
+                p = MIN(p, MAX(0, 9 * (z - r - 1) - j));
+            } else {
+                p = MIN(p, MAX(0, 9 * (z - r - 1) + e - j));
+            }
+        }
+    }
+    if (p > INT_MAX - 1 - (p || (fl & FLAGS_HASH)))
+        return -1;
+    l = 1 + p + (p || (fl & FLAGS_HASH));
+    if ((t | 32) == 'f') {
+        if (e > INT_MAX - l)
+            return -1;
+        if (e > 0)
+            l += e;
+    } else {
+        estr = fmt_u(e < 0 ? -e : e, ebuf);
+        while (ebuf - estr < 2)
+            *--estr = '0';
+        *--estr = (e < 0 ? '-' : '+');
+        *--estr = t;
+        if (ebuf - estr > INT_MAX - l)
+            return -1;
+        l += ebuf - estr;
+    }
+
+    if (l > INT_MAX - pl)
+        return -1;
+    pad(f, ' ', w, pl + l, fl);
+    out(f, prefix, pl);
+    pad(f, '0', w, pl + l, fl ^ FLAGS_ZEROPAD);
+
+    // Once the output is dropped or the stop mark is reached, the rest of the
+    // digits is only counted.
+    size_t end = f->idx + l;
+    fp_digits(f, a, r, z, p, fl, t, estr, ebuf - estr);
+    out_skip(f, end - f->idx);
+
+    pad(f, ' ', w, pl + l, fl ^ FLAGS_LEFT);
+
+    return MAX(w, pl + l);
+}
+
+// Parse literal text and the following conversion specification at *format
+// into *spec, and advance *format past it. spec->conv is set to 0 if the end
+// of the format string was reached. Returns false if the conversion is invalid
+// (*format then points past the invalid part).
+static bool parse_spec(const char **format_p, struct lin_format_spec *spec)
+{
+    const char *format = *format_p;
+
+    // Literal text is copied with a single out() call by the caller. Find its
+    // end with strcspn(), which libcs usually implement with SIMD or SWAR.
+    spec->text = format;
+    spec->text_len = strcspn(format, "%");
+    format += spec->text_len;
+
+    spec->conv = 0;
+    if (!*format) {
+        *format_p = format;
+        return true;
+    }
+
+    // format specifier:  %[flags][width][.precision][length]
+    format++;
+
+    // evaluate flags
+    unsigned int flags = 0U;
+    while (1) {
+        bool done = false;
+        switch (*format) {
+        case '0':
+            flags |= FLAGS_ZEROPAD;
+            break;
+        case '-':
+            flags |= FLAGS_LEFT;
+            break;
+        case '+':
+            flags |= FLAGS_PLUS;
+            break;
+        case ' ':
+            flags |= FLAGS_SPACE;
+            break;
+        case '#':
+            flags |= FLAGS_HASH;
+            break;
+        default:
+            done = true;
+            break;
+        }
+        if (done)
+            break;
+        format++;
+    }
+
+    // evaluate width field
+    int width = 0;
+    if (*format == '*') {
+        flags |= FLAGS_WIDTH_ARG;
+        format++;
+    } else {
+        width = fmt_atoi(&format);
+    }
+
+    // evaluate precision field
+    int precision = -1;
+    if (*format == '.') {
+        format++;
+        if (*format == '*') {
+            flags |= FLAGS_PREC_ARG;
+            format++;
+        } else {
+            precision = fmt_atoi(&format);
+        }
+    }
+
+    // evaluate length field
+    int type = TYPE_NONE;
+    switch (*format) {
+    case 'l':
+        type = TYPE_LONG;
+        format++;
+        if (*format == 'l') {
+            type = TYPE_LLONG;
+            format++;
+        }
+        break;
+    case 'h':
+        type = TYPE_SHORT;
+        format++;
+        if (*format == 'h') {
+            type = TYPE_CHAR;
+            format++;
+        }
+        break;
+    case 't':
+    case 'z':
+        type = TYPE_SIZE; // assumption that size_t == unsigned ptrdiff_t
+        format++;
+        break;
+    case 'j': ;
+        type = TYPE_INTMAX;
+        format++;
+        break;
+    case 'I':
+        if (format[1] == '6' && format[2] == '4') {
+            type = TYPE_I64;
+            format += 3;
+#ifdef __SIZEOF_INT128__
+        } else if (format[1] == '1' && format[2] == '2' && format[3] == '8') {
+            type = TYPE_I128;
+            format += 4;
+#endif
+        } else if (format[1] == '3' && format[2] == '2') {
+            type = TYPE_I32;
+            format += 3;
+        } else if (format[1] == '1' && format[2] == '6') {
+            type = TYPE_SHORT;
+            format += 3;
+        } else if (format[1] == '8') {
+            type = TYPE_CHAR;
+            format += 2;
+        } else if (!(format[1] >= '0' && format[1] <= '9')) {
+            type = TYPE_SIZE; // MS extension for ptrdiff_t and size_t
+            format += 1;
+        }
+        break;
+    default:
+        break;
+    }
+
+    spec->flags = flags;
+    spec->width = width;
+    spec->prec = precision;
+    spec->type = type;
+
+    // evaluate specifier
+    char fmt = *format;
+    if (fmt)
+        format++;
+    *format_p = format;
+    switch (fmt) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'p': case 'o':
+    case 'b':
+    case 'f': case 'F': case 'g': case 'G': case 'e': case 'E': case 'a':
+    case 'A': case 'v': case 'V':
+    case 'D':
+    case 'c': case 's': case 'q': case 'r': case 'H': case '%':
+        spec->conv = fmt;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static int vsnprintf_(struct buf *buffer, const char *format, va_list va);
+
+// Integer conversions (d i u x X p o b) of the absolute value val. hi is the
+// upper half of 128 bit values (always 0 without __int128 support).
+static void format_int(struct buf *buffer, char fmt, uintmax_t val,
+                       uint64_t hi, bool negative, int precision, int width,
+                       unsigned int flags)
+{
+    // set the base
+    unsigned int base = 10U;
+    if (fmt == 'x' || fmt == 'X' || fmt == 'p')
+        base = 16U;
+    else if (fmt == 'o')
+        base =  8U;
+    else if (fmt == 'b') {
+        base =  2U;
+    }
+
+    // uppercase
+    if (fmt == 'X')
+        flags |= FLAGS_UPPERCASE;
+
+    if (fmt == 'p')
+        flags |= FLAGS_HASH;
+
+    // if a precision is specified, the 0 flag is ignored
+    if (precision >= 0)
+        flags &= ~FLAGS_ZEROPAD;
+
+    if (fmt != 'i' && fmt != 'd')
+        flags &= ~(FLAGS_PLUS | FLAGS_SPACE);
+
+#ifdef __SIZEOF_INT128__
+    if (hi) {
+        char number[128];
+        int len = write_digits128(number + sizeof(number),
+                                  ((unsigned __int128)hi << 64) | val, base,
+                                  flags);
+        ntoa_layout(buffer, 1, number + sizeof(number) - len, len, negative,
+                    base, precision, width, flags);
+        return;
+    }
+#else
+    assert(!hi);
+#endif
+    ntoa_format(buffer, val, negative, base, precision, width, flags);
+}
+
+// Fixed-point conversion (D): output the absolute value val, scaled by
+// 10^-scale, as decimal number with prec digits after the radix point (default:
+// scale; excess digits are rounded to nearest, ties to even). Returns false if
+// scale is not in [0, 19].
+static bool format_fixed(struct buf *buffer, uint64_t val, bool negative,
+                         int scale, int prec, int width, unsigned int flags)
+{
+    if (scale < 0 || scale > 19)
+        return false;
+    if (prec < 0)
+        prec = scale;
+
+    // Number of digits after the radix point in val.
+    int f = scale;
+    if (prec < scale) {
+        uint64_t div = pow10_64[scale - prec];
+        uint64_t rem = val % div;
+        val /= div;
+        if (rem > div / 2 || (rem == div / 2 && (val & 1)))
+            val++;
+        f = prec;
+    }
+
+    uint64_t ipart = val / pow10_64[f];
+    uint64_t fpart = val % pow10_64[f];
+    int ilen = count_digits(ipart, 10);
+    int flen = fpart ? count_digits(fpart, 10) : 0;
+    bool point = prec || (flags & FLAGS_HASH);
+
+    char prefix = 0;
+    if (negative) {
+        prefix = '-';
+    } else if (flags & FLAGS_PLUS) {
+        prefix = '+';
+    } else if (flags & FLAGS_SPACE) {
+        prefix = ' ';
+    }
+
+    size_t total_len = !!prefix + ilen + point + (size_t)prec;
+    size_t pad_len = width > total_len ? width - total_len : 0;
+    size_t zero_pad = 0, space_pad = pad_len;
+    if ((flags & FLAGS_ZEROPAD) && !(flags & FLAGS_LEFT)) {
+        zero_pad = pad_len;
+        space_pad = 0;
+    }
+    HOOK_PAD(buffer, pad_len);
+
+    if (out_discard(buffer)) {
+        out_skip(buffer, total_len + pad_len);
+        return true;
+    }
+
+    char number[20 + 1 + 19];
+    char *d = number;
+    write_dec(d, ilen, ipart);
+    d += ilen;
+    if (point)
+        *d++ = '.';
+    d = put_pad(d, '0', f - flen);
+    if (flen)
+        write_dec(d, flen, fpart);
+    d += flen;
+
+    if (!(flags & FLAGS_LEFT))
+        out_pad(buffer, ' ', space_pad);
+    if (prefix)
+        outc(buffer, prefix);
+    out_pad(buffer, '0', zero_pad);
+    out(buffer, number, d - number);
+    out_pad(buffer, '0', prec - f);
+    if (flags & FLAGS_LEFT)
+        out_pad(buffer, ' ', space_pad);
+    return true;
+}
+
+// Whether %q must escape c (C escaping, or JSON if json is set).
+static inline bool q_special(unsigned char c, bool json)
+{
+    return c < 0x20 || c == '"' || c == '\\' || (c == 0x7F && !json);
+}
+
+// Return the length of the prefix of s[0..len) that needs no escaping. Tests 8
+// bytes per step: a byte of w is < 0x20 iff subtracting 0x20 borrows into its
+// high bit (with the high bit clear before), and equal to c iff w ^ c*ones has
+// a 0 byte.
+static size_t q_clean_len(const char *s, size_t len, bool json)
+{
+    const uint64_t ones = UINT64_C(0x0101010101010101), highs = ones * 0x80;
+    size_t n = 0;
+
+    for (; len - n >= 8; n += 8) {
+        uint64_t w, q, b, d;
+        memcpy(&w, s + n, 8);
+        q = w ^ (ones * '"');
+        b = w ^ (ones * '\\');
+        d = w ^ (ones * 0x7F);
+        uint64_t r = ((w - ones * 0x20) & ~w) | ((q - ones) & ~q) |
+                     ((b - ones) & ~b);
+        if (!json)
+            r |= (d - ones) & ~d;
+        if (r & highs)
+            break;
+    }
+
+    while (n < len && !q_special(s[n], json))
+        n++;
+    return n;
+}
+
+// Write the escape sequence for c (with q_special(c, json)) to d, and return
+// its length (at most 6).
+static int q_escape(char *d, unsigned char c, bool json)
+{
+    d[0] = '\\';
+    switch (c) {
+    case '"':
+    case '\\': d[1] = c;   return 2;
+    case '\n': d[1] = 'n'; return 2;
+    case '\t': d[1] = 't'; return 2;
+    case '\r': d[1] = 'r'; return 2;
+    case '\b': d[1] = 'b'; return 2;
+    case '\f': d[1] = 'f'; return 2;
+    }
+    if (json) {
+        memcpy(d + 1, "u00", 3);
+        d[4] = xdigits[c >> 4] | 32;
+        d[5] = xdigits[c & 15] | 32;
+        return 6;
+    }
+    switch (c) {
+    case '\a': d[1] = 'a'; return 2;
+    case '\v': d[1] = 'v'; return 2;
+    }
+    // (Always 3 digits, so that a following digit can't extend it.)
+    d[1] = '0' + (c >> 6);
+    d[2] = '0' + ((c >> 3) & 7);
+    d[3] = '0' + (c & 7);
+    return 4;
+}
+
+// Quoted string conversion (q): output s[0..len) in double quotes, escaped
+// as C string literal, or as JSON string if '#' is set. Runs of bytes that
+// need no escaping are copied with a single out() call.
+static void format_quoted(struct buf *buffer, const char *s, size_t len,
+                          int width, unsigned int flags)
+{
+    bool json = flags & FLAGS_HASH;
+    char esc[6];
+    size_t total = len + 2; // (lower bound)
+
+    // The escaped length is only needed for padding, or if there's no output.
+    if (width > total || out_discard(buffer)) {
+        total = 2;
+        for (size_t n = 0; n < len; n++) {
+            size_t clean = q_clean_len(s + n, len - n, json);
+            total += clean;
+            n += clean;
+            if (n < len)
+                total += q_escape(esc, s[n], json);
+        }
+        if (width > total)
+            HOOK_PAD(buffer, width - total);
+        if (out_discard(buffer)) {
+            out_skip(buffer, MAX(width, total));
+            return;
+        }
+    }
+
+    if (!(flags & FLAGS_LEFT) && width > total)
+        out_pad(buffer, ' ', width - total);
+
+    outc(buffer, '"');
+    for (size_t n = 0; n < len; n++) {
+        size_t clean = q_clean_len(s + n, len - n, json);
+        out(buffer, s + n, clean);
+        n += clean;
+        if (n < len)
+            out(buffer, esc, q_escape(esc, s[n], json));
+    }
+    outc(buffer, '"');
+
+    if ((flags & FLAGS_LEFT) && width > total)
+        out_pad(buffer, ' ', width - total);
+}
+
+// Write the 8 hex digits of the 4 bytes s[0..4) to d[0..8). letter is the
+// offset from '0' + 10 to the letters ('a' - '0' - 10 or 'A' - '0' - 10).
+// The nibbles are moved into the byte lanes of a 64 bit integer, and all of
+// them are converted to ASCII at once (SWAR): adding 6 carries into bit 4 of
+// a lane exactly for nibbles >= 10, which selects the letter offset.
+static inline void write_hex8(char *d, const unsigned char *s, uint64_t letter)
+{
+    uint64_t x = s[0] | (uint64_t)s[1] << 16 | (uint64_t)s[2] << 32 |
+                 (uint64_t)s[3] << 48;
+    x = ((x >> 4) & UINT64_C(0x000F000F000F000F)) |
+        ((x & UINT64_C(0x000F000F000F000F)) << 8);
+    uint64_t alpha = ((x + UINT64_C(0x0606060606060606)) >> 4) &
+                     UINT64_C(0x0101010101010101);
+    x += UINT64_C(0x3030303030303030) + alpha * letter;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(d, &x, 8);
+#else
+    for (int i = 0; i < 8; i++)
+        d[i] = (char)(x >> (i * 8));
+#endif
+}
+
+// Write s[0..len) as hex to d, with a space between bytes if sep (and before
+// the first one if lead). Returns the number of chars written.
+static size_t write_hex(char *d, const unsigned char *s, size_t len, bool sep,
+                        bool lead, unsigned int flags)
+{
+    const char *digits = flags & FLAGS_UPPERCASE ? upper_digits : lower_digits;
+    uint64_t letter = digits[10] - '0' - 10;
+    char *p = d;
+    size_t n = 0;
+    for (; n + 4 <= len; n += 4) {
+        if (!sep) {
+            write_hex8(p, s + n, letter);
+            p += 8;
+            continue;
+        }
+        char t[8];
+        write_hex8(t, s + n, letter);
+        for (int i = 0; i < 4; i++) {
+            if (p > d || lead)
+                *p++ = ' ';
+            memcpy(p, t + i * 2, 2);
+            p += 2;
+        }
+    }
+    for (; n < len; n++) {
+        if (sep && (p > d || lead))
+            *p++ = ' ';
+        p[0] = digits[s[n] >> 4];
+        p[1] = digits[s[n] & 15];
+        p += 2;
+    }
+    return p - d;
+}
+
+// Hex dump conversion (H) of the len bytes at s.
+static void format_hex(struct buf *buffer, const unsigned char *s, size_t len,
+                       int width, unsigned int flags)
+{
+    bool sep = flags & FLAGS_SPACE;
+    size_t total = len * 2 + (sep && len ? len - 1 : 0);
+
+    if (width > total)
+        HOOK_PAD(buffer, width - total);
+
+    if (out_discard(buffer)) {
+        out_skip(buffer, MAX(width, total));
+        return;
+    }
+
+    if (!(flags & FLAGS_LEFT) && width > total)
+        out_pad(buffer, ' ', width - total);
+
+    char *d = out_reserve(buffer, total);
+    if (d) {
+        write_hex(d, s, len, sep, false, flags);
+        out_commit(buffer, total);
+    } else {
+        char tmp[64 * 3];
+        bool lead = false;
+        while (len && !out_discard(buffer)) {
+            size_t n = MIN(len, sizeof(tmp) / 3);
+            out(buffer, tmp, write_hex(tmp, s, n, sep, lead, flags));
+            s += n;
+            len -= n;
+            lead = true;
+        }
+        if (len)
+            out_skip(buffer, len * 2 + (sep ? len - !lead : 0));
+    }
+
+    if ((flags & FLAGS_LEFT) && width > total)
+        out_pad(buffer, ' ', width - total);
+}
+
+// Where format_spec() takes the arguments from: the va_list va, or if arr is
+// not NULL, the array arr (see lin_snprintf_args()).
+struct args {
+    va_list *va;
+    const union lin_format_arg *arr;
+};
+
+// Fetch a signed integer argument of the given length modifier type.
+static intmax_t get_signed(struct args *args, int type)
+{
+    va_list *va = args->va;
+
+    if (args->arr)
+        return (args->arr++)->i;
+
+    switch (type) {
+    case TYPE_NONE:     return va_arg(*va, int);
+    case TYPE_I32:      return va_arg(*va, int32_t);
+    case TYPE_CHAR:     return (signed char)va_arg(*va, int);
+    case TYPE_SHORT:    return (short)va_arg(*va, int);
+    case TYPE_LONG:     return va_arg(*va, long);
+    case TYPE_I64:      return va_arg(*va, int64_t);
+    case TYPE_LLONG:    return va_arg(*va, long long);
+    case TYPE_INTMAX:   return va_arg(*va, intmax_t);
+    case TYPE_SIZE:     return va_arg(*va, ptrdiff_t);
+    default: assert(0); return 0;
+    }
+}
+
+// Output the conversion described by spec; fetches arguments from va.
+static int format_conv(struct buf *buffer, const struct lin_format_spec *spec,
+                       struct args *args)
+{
+    va_list *va = args->va;
+    unsigned int flags = spec->flags;
+    int width = spec->width;
+    int precision = spec->prec;
+    int type = spec->type;
+    char fmt = spec->conv;
+
+    if (flags & FLAGS_WIDTH_ARG) {
+        width = args->arr ? (args->arr++)->i : va_arg(*va, int);
+        if (width < 0) {
+            flags |= FLAGS_LEFT; // reverse padding
+            width = width == INT_MIN ? INT_MAX : -width;
+        }
+    }
+
+    if (flags & FLAGS_PREC_ARG)
+        precision = args->arr ? (args->arr++)->i : va_arg(*va, int);
+
+    // "A - overrides a 0 if both are given."
+    if (flags & FLAGS_LEFT)
+        flags &= ~FLAGS_ZEROPAD;
+
+    switch (fmt) {
+    case 'd':
+    case 'i':
+    case 'u':
+    case 'x':
+    case 'X':
+    case 'p':
+    case 'o':
+    case 'b': {
+        if (fmt == 'p')
+            type = TYPE_PTR;
+
+#ifdef __SIZEOF_INT128__
+        if (type == TYPE_I128) {
+            // (union lin_format_arg has no 128 bit member)
+            if (args->arr) {
+                out(buffer, "<error>", 7);
+                return -1;
+            }
+            unsigned __int128 val;
+            bool negative = false;
+            if (fmt == 'i' || fmt == 'd') {
+                __int128 sval = va_arg(*va, __int128);
+                negative = sval < 0;
+                val = negative ? -(unsigned __int128)sval : (unsigned __int128)sval;
+            } else {
+                val = va_arg(*va, unsigned __int128);
+            }
+            format_int(buffer, fmt, (uint64_t)val, (uint64_t)(val >> 64),
+                       negative, precision, width, flags);
+            break;
+        }
+#endif
+
+        // convert the integer
+        if (fmt == 'i' || fmt == 'd') {
+            // signed
+            intmax_t val = get_signed(args, type);
+            format_int(buffer, fmt, val < 0 ? -(uintmax_t)val : val, 0,
+                       val < 0, precision, width, flags);
+        } else {
+            // unsigned
+            uintmax_t val;
+            if (args->arr) {
+                val = type == TYPE_PTR ? (uintptr_t)args->arr->p : args->arr->u;
+                args->arr++;
+            } else {
+                switch (type) {
+                case TYPE_NONE:     val = va_arg(*va, unsigned);                 break;
+                case TYPE_I32:      val = va_arg(*va, uint32_t);                 break;
+                case TYPE_CHAR:     val = (unsigned char)va_arg(*va, unsigned);  break;
+                case TYPE_SHORT:    val = (unsigned short)va_arg(*va, unsigned); break;
+                case TYPE_LONG:     val = va_arg(*va, unsigned long);            break;
+                case TYPE_I64:      val = va_arg(*va, uint64_t);                 break;
+                case TYPE_LLONG:    val = va_arg(*va, unsigned long long);       break;
+                case TYPE_INTMAX:   val = va_arg(*va, uintmax_t);                break;
+                case TYPE_SIZE:     val = va_arg(*va, size_t);                   break;
+                case TYPE_PTR:      val = (uintptr_t)va_arg(*va, void *);        break;
+                default: assert(0);
+                }
+            }
+            format_int(buffer, fmt, val, 0, false, precision, width, flags);
+        }
+        break;
+    }
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'e':
+    case 'E':
+    case 'a':
+    case 'A':
+    case 'v':
+    case 'V': {
+        double val = args->arr ? (args->arr++)->d : va_arg(*va, double);
+        if (fmt_fp(buffer, val, width, precision, flags, fmt) < 0)
+            out(buffer, "<error>", 7);
+        break;
+    }
+    case 'D': {
+        if (type == TYPE_I128) {
+            out(buffer, "<error>", 7);
+            return -1;
+        }
+        int scale = args->arr ? (args->arr++)->i : va_arg(*va, int);
+        intmax_t val = get_signed(args, type);
+        if (!format_fixed(buffer, val < 0 ? -(uintmax_t)val : val, val < 0,
+                          scale, precision, width, flags))
+        {
+            out(buffer, "<error>", 7);
+            return -1;
+        }
+        break;
+    }
+    case 'c': {
+        if (width > 1)
+            HOOK_PAD(buffer, width - 1);
+        // pre padding
+        if (!(flags & FLAGS_LEFT) && width > 1)
+            out_pad(buffer, ' ', width - 1);
+        // char output
+        outc(buffer, (char)(args->arr ? (args->arr++)->i : va_arg(*va, int)));
+        // post padding
+        if ((flags & FLAGS_LEFT) && width > 1)
+            out_pad(buffer, ' ', width - 1);
+        break;
+    }
+
+    case 's':
+    case 'q': {
+        const char *p = args->arr ? (args->arr++)->s : va_arg(*va, char *);
+        size_t l, max = precision >= 0 ? (size_t)precision : SIZE_MAX;
+        if (buffer->stop) {
+            // Only scan as much as is needed to fill the buffer and to know
+            // the padding; if the string is longer, the output is truncated.
+            max = MIN(max, MAX((size_t)(buffer->end - buffer->dst),
+                               (size_t)width) + 1);
+        }
+        if (max != SIZE_MAX) {
+            // (The string doesn't need to be 0-terminated in this case.)
+            const char *end = memchr(p, '\0', max);
+            l = end ? end - p : max;
+        } else {
+            l = strlen(p);
+        }
+        if (fmt == 'q') {
+            format_quoted(buffer, p, l, width, flags);
+            break;
+        }
+        if (width > l)
+            HOOK_PAD(buffer, width - l);
+        // pre padding
+        if (!(flags & FLAGS_LEFT) && width > l)
+            out_pad(buffer, ' ', width - l);
+        // string output
+        out_str(buffer, p, l);
+        // post padding
+        if ((flags & FLAGS_LEFT) && width > l)
+            out_pad(buffer, ' ', width - l);
+        break;
+    }
+
+    case 'H': {
+        const void *p = args->arr ? (args->arr++)->p : va_arg(*va, void *);
+        // (The precision is the number of bytes and is required.)
+        if (precision < 0) {
+            out(buffer, "<error>", 7);
+            return -1;
+        }
+        if (flags & FLAGS_HASH)
+            flags |= FLAGS_UPPERCASE;
+        format_hex(buffer, p, precision, width, flags);
+        break;
+    }
+
+    case 'r': {
+        if (args->arr) {
+            // (Can't be passed without va_list.)
+            out(buffer, "<error>", 7);
+            return -1;
+        }
+        const char *format_r = va_arg(*va, char *);
+        struct lin_va_list args_r = va_arg(*va, struct lin_va_list);
+        int rerr = 0;
+        va_list va_r;
+        va_copy(va_r, *args_r.ap);
+        rerr = vsnprintf_(buffer, format_r, va_r);
+        va_end(va_r);
+        return rerr < 0 ? rerr : 0;
+    }
+
+    case '%':
+        outc(buffer, '%');
+        break;
+
+    default:
+        assert(0);
+    }
+
+    return 0;
+}
+
+// format_conv(), and report the conversion to buffer->hooks if enabled.
+static int format_spec(struct buf *buffer, const struct lin_format_spec *spec,
+                       struct args *args)
+{
+#if LIN_PRINTF_HOOKS
+    if (buffer->hooks) {
+        // (Nested conversions of %r use their own info.)
+        struct lin_conv_info info = {.conv = spec->conv};
+        struct lin_conv_info *outer = buffer->info;
+        size_t idx = buffer->idx;
+        buffer->info = &info;
+        int r = format_conv(buffer, spec, args);
+        buffer->info = outer;
+        info.bytes = buffer->idx - idx;
+        buffer->hooks->conv(buffer->hooks->ctx, &info);
+        return r;
+    }
+#endif
+    return format_conv(buffer, spec, args);
+}
+
+// Return value of the snprintf() functions.
+static int finish(struct buf *buffer, int err)
+{
     if (buffer->overflow)
         err = -1;
 
-    if (err)
-        return err;
+    if (err)
+        return err;
+
+    // (The full length of truncated output is unknown in this case.)
+    if (out_stop(buffer))
+        return buffer->stop <= INT_MAX ? buffer->stop : -1;
+
+    // return total number of chars, including the amount outside of the buffer
+    return buffer->idx <= INT_MAX ? buffer->idx : -1;
+}
+
+// internal vsnprintf
+static int vsnprintf_(struct buf *buffer, const char *format, va_list va)
+{
+    int err = 0;
+    va_list ap;
+
+    va_copy(ap, va);
+    struct args args = {.va = &ap};
+
+    while (1) {
+        struct lin_format_spec spec;
+        if (!parse_spec(&format, &spec)) {
+            out(buffer, spec.text, format - spec.text);
+            out(buffer, "<error>", 7);
+            err = -1;
+            continue;
+        }
+        out(buffer, spec.text, spec.text_len);
+        if (!spec.conv || out_stop(buffer))
+            break;
+        int rerr = format_spec(buffer, &spec, &args);
+        if (!err)
+            err = rerr;
+    }
+
+    va_end(ap);
+
+    return finish(buffer, err);
+}
+
+// vsnprintf on a compiled format
+static int vsnprintf_compiled_(struct buf *buffer,
+                               const struct lin_format_spec *spec, va_list va)
+{
+    int err = 0;
+    va_list ap;
+
+    va_copy(ap, va);
+    struct args args = {.va = &ap};
 
-    // return total number of chars, including the amount outside of the buffer
-    return buffer->idx <= INT_MAX ? buffer->idx : -1;
+    for (;; spec++) {
+        out(buffer, spec->text, spec->text_len);
+        if (!spec->conv)
+            break;
+        int rerr = format_spec(buffer, spec, &args);
+        if (!err)
+            err = rerr;
+    }
+
+    va_end(ap);
+
+    return finish(buffer, err);
+}
+
+int lin_format_len(const char *format, ...)
+{
+    va_list va;
+    va_start(va, format);
+    int ret = lin_vformat_len(format, va);
+    va_end(va);
+    return ret;
+}
+
+int lin_vformat_len(const char *format, va_list va)
+{
+    return lin_vsnprintf(NULL, 0, format, va);
+}
+
+int lin_u64toa(char *dst, size_t size, uint64_t v, unsigned int base)
+{
+    if (base != 10 && base != 16 && base != 8 && base != 2)
+        return -1;
+    int n = count_digits(v, base);
+    if (n > size)
+        return -1;
+    write_digits(dst, n, v, base, 0);
+    return n;
+}
+
+int lin_i64toa(char *dst, size_t size, int64_t v, unsigned int base)
+{
+    if (v >= 0)
+        return lin_u64toa(dst, size, v, base);
+    if (!size)
+        return -1;
+    int n = lin_u64toa(dst + 1, size - 1, -(uint64_t)v, base);
+    if (n < 0)
+        return -1;
+    dst[0] = '-';
+    return n + 1;
+}
+
+int lin_u32toa(char *dst, size_t size, uint32_t v, unsigned int base)
+{
+    return lin_u64toa(dst, size, v, base);
 }
 
 int lin_snprintf(char *buffer, size_t count, const char *format, ...)
@@ -832,3 +2509,589 @@ int lin_vsnprintf(char *buffer, size_t count, const char *format, va_list va)
 
     return res;
 }
+
+int lin_snprintf_trunc(char *buffer, size_t count, const char *format, ...)
+{
+    va_list va;
+    va_start(va, format);
+    int ret = lin_vsnprintf_trunc(buffer, count, format, va);
+    va_end(va);
+    return ret;
+}
+
+int lin_vsnprintf_trunc(char *buffer, size_t count, const char *format,
+                        va_list va)
+{
+    struct buf buf = {
+        .dst = buffer,
+        // (Always reserve 1 byte for the \0 if there's space.)
+        .end = count ? buffer + count - 1 : buffer,
+        // (Output is truncated once it's longer than count - 1.)
+        .stop = count,
+    };
+
+    int res = vsnprintf_(&buf, format, va);
+
+    // termination
+    if (count)
+        buf.dst[0] = '\0';
+
+    return res;
+}
+
+int lin_vsnprintf_ex(char *buffer, size_t count,
+                     const struct lin_printf_hooks *hooks, const char *format,
+                     va_list va)
+{
+    struct buf buf = {
+        .dst = buffer,
+        // (Always reserve 1 byte for the \0 if there's space.)
+        .end = count ? buffer + count - 1 : buffer,
+#if LIN_PRINTF_HOOKS
+        .hooks = hooks,
+#endif
+    };
+
+    (void)hooks;
+    int res = vsnprintf_(&buf, format, va);
+
+    // termination
+    if (count)
+        buf.dst[0] = '\0';
+
+    return res;
+}
+
+// Output through a callback, staged in a small buffer.
+struct cb_buf {
+    struct buf buf; // must be first
+    lin_printf_cb cb;
+    void *ctx;
+    char tmp[256];
+};
+
+static bool cb_flush(struct buf *buf)
+{
+    struct cb_buf *cb = (struct cb_buf *)buf;
+    if (buf->dst > cb->tmp)
+        cb->cb(cb->ctx, cb->tmp, buf->dst - cb->tmp);
+    buf->dst = cb->tmp;
+    return true;
+}
+
+int lin_cbprintf(lin_printf_cb cb, void *ctx, const char *format, ...)
+{
+    va_list va;
+    va_start(va, format);
+    int ret = lin_vcbprintf(cb, ctx, format, va);
+    va_end(va);
+    return ret;
+}
+
+int lin_vcbprintf(lin_printf_cb cb, void *ctx, const char *format, va_list va)
+{
+    struct cb_buf buf = {
+        .buf = {
+            .dst = buf.tmp,
+            .end = buf.tmp + sizeof(buf.tmp),
+            .flush = cb_flush,
+        },
+        .cb = cb,
+        .ctx = ctx,
+    };
+
+    int res = vsnprintf_(&buf.buf, format, va);
+
+    cb_flush(&buf.buf);
+
+    return res;
+}
+
+// Output as iovec entries: generated text goes to a scratch buffer, and long
+// strings are referenced.
+struct iov_buf {
+    struct buf buf; // must be first
+    struct lin_iovec *iov;
+    size_t iov_num;     // used entries
+    size_t iov_max;     // available entries
+    size_t iov_bytes;   // sum of the iov_len of the used entries
+    char *text;         // start of scratch text not added to iov yet
+    size_t ref_min;
+};
+
+// Add an iov entry for p[0..l). If iov is full, drop all further output.
+static bool iov_push(struct iov_buf *b, const void *p, size_t l)
+{
+    if (b->iov_num == b->iov_max) {
+        b->buf.end = b->buf.dst;
+        return false;
+    }
+    b->iov[b->iov_num++] = (struct lin_iovec){(void *)p, l};
+    b->iov_bytes += l;
+    return true;
+}
+
+// Add an iov entry for the pending scratch text, and then (if s is not NULL)
+// one referencing s[0..l).
+static bool iov_add(struct iov_buf *b, const char *s, size_t l)
+{
+    size_t text_len = b->buf.dst - b->text;
+    if (text_len) {
+        if (!iov_push(b, b->text, text_len))
+            return false;
+        b->text = b->buf.dst;
+    }
+    return !s || iov_push(b, s, l);
+}
+
+static bool iov_ref(struct buf *buf, const char *s, size_t l)
+{
+    struct iov_buf *b = (struct iov_buf *)buf;
+    // If anything was dropped (scratch or iov full), the output is truncated
+    // and nothing may be added after the gap.
+    if (!l || l < b->ref_min || buf->idx != b->iov_bytes + (buf->dst - b->text))
+        return false;
+    return iov_add(b, s, l);
+}
+
+int lin_format_iov(struct lin_iovec *iov, size_t *iov_count, char *scratch,
+                   size_t scratch_size, size_t ref_min, const char *format, ...)
+{
+    va_list va;
+    va_start(va, format);
+    int ret = lin_vformat_iov(iov, iov_count, scratch, scratch_size, ref_min,
+                              format, va);
+    va_end(va);
+    return ret;
+}
+
+int lin_vformat_iov(struct lin_iovec *iov, size_t *iov_count, char *scratch,
+                    size_t scratch_size, size_t ref_min, const char *format,
+                    va_list va)
+{
+    struct iov_buf buf = {
+        .buf = {
+            .dst = scratch,
+            .end = scratch + scratch_size,
+            .ref = iov_ref,
+        },
+        .iov = iov,
+        .iov_max = *iov_count,
+        .text = scratch,
+        .ref_min = ref_min,
+    };
+
+    int res = vsnprintf_(&buf.buf, format, va);
+
+    iov_add(&buf, NULL, 0);
+    *iov_count = buf.iov_num;
+
+    return res;
+}
+
+// Output into a lin_strbuf, growing it as needed.
+struct strbuf_buf {
+    struct buf buf; // must be first
+    struct lin_strbuf *sb;
+};
+
+static bool strbuf_flush(struct buf *buf)
+{
+    struct lin_strbuf *sb = ((struct strbuf_buf *)buf)->sb;
+    size_t len = buf->dst - sb->str;
+    size_t new_size = sb->size < 64 ? 64 : sb->size * 2;
+    if (new_size <= sb->size)
+        return false;
+    char *str = sb->realloc_cb(sb->ctx, sb->str, new_size);
+    if (!str)
+        return false;
+    sb->str = str;
+    sb->size = new_size;
+    buf->dst = str + len;
+    // (Always reserve 1 byte for the \0.)
+    buf->end = str + new_size - 1;
+    return true;
+}
+
+int lin_strbuf_printf(struct lin_strbuf *sb, const char *format, ...)
+{
+    va_list va;
+    va_start(va, format);
+    int ret = lin_strbuf_vprintf(sb, format, va);
+    va_end(va);
+    return ret;
+}
+
+int lin_strbuf_vprintf(struct lin_strbuf *sb, const char *format, va_list va)
+{
+    struct strbuf_buf buf = {
+        .buf = {
+            .dst = sb->str + sb->len,
+            .end = sb->size ? sb->str + sb->size - 1 : sb->str,
+            .flush = strbuf_flush,
+        },
+        .sb = sb,
+    };
+
+    int res = vsnprintf_(&buf.buf, format, va);
+
+    // If something was dropped, growing the buffer failed.
+    if (res >= 0 && buf.buf.dst - (sb->str + sb->len) != res)
+        res = -1;
+
+    if (res >= 0)
+        sb->len += res;
+    if (sb->size)
+        sb->str[sb->len] = '\0';
+
+    return res;
+}
+
+void lin_strbuf_free(struct lin_strbuf *sb)
+{
+    if (sb->str)
+        sb->realloc_cb(sb->ctx, sb->str, 0);
+    sb->str = NULL;
+    sb->len = sb->size = 0;
+}
+
+int lin_format_compile(struct lin_format_spec *specs, size_t num_specs,
+                       const char *format)
+{
+    size_t n = 0;
+
+    while (1) {
+        struct lin_format_spec spec;
+        if (!parse_spec(&format, &spec))
+            return -1;
+        if (n < num_specs)
+            specs[n] = spec;
+        n++;
+        if (n > INT_MAX)
+            return -1;
+        if (!spec.conv)
+            break;
+    }
+
+    return n;
+}
+
+int lin_snprintf_compiled(char *buffer, size_t count,
+                          const struct lin_format_spec *specs, ...)
+{
+    va_list va;
+    va_start(va, specs);
+    int ret = lin_vsnprintf_compiled(buffer, count, specs, va);
+    va_end(va);
+    return ret;
+}
+
+int lin_vsnprintf_compiled(char *buffer, size_t count,
+                           const struct lin_format_spec *specs, va_list va)
+{
+    struct buf buf = {
+        .dst = buffer,
+        // (Always reserve 1 byte for the \0 if there's space.)
+        .end = count ? buffer + count - 1 : buffer,
+    };
+
+    int res = vsnprintf_compiled_(&buf, specs, va);
+
+    // termination
+    if (count)
+        buf.dst[0] = '\0';
+
+    return res;
+}
+
+int lin_snprintf_args(char *buffer, size_t count,
+                      const struct lin_format_spec *spec,
+                      const union lin_format_arg *arr)
+{
+    struct buf buf = {
+        .dst = buffer,
+        // (Always reserve 1 byte for the \0 if there's space.)
+        .end = count ? buffer + count - 1 : buffer,
+    };
+    struct args args = {.arr = arr};
+    int err = 0;
+
+    for (;; spec++) {
+        out(&buf, spec->text, spec->text_len);
+        if (!spec->conv)
+            break;
+        int rerr = format_spec(&buf, spec, &args);
+        if (!err)
+            err = rerr;
+    }
+
+    int res = finish(&buf, err);
+
+    // termination
+    if (count)
+        buf.dst[0] = '\0';
+
+    return res;
+}
+
+// lin_format_array() arguments, parsed and checked once per call.
+struct array_fmt {
+    struct lin_format_spec specs[2];
+    const char *sep;
+    size_t sep_len;
+    enum lin_elem_type elem_type;
+    size_t stride;
+    unsigned int flags;
+    bool is_float;
+    bool plain;
+    size_t plain_max;
+};
+
+static bool array_fmt_init(struct array_fmt *af, const char *spec,
+                           const char *sep, enum lin_elem_type elem_type,
+                           size_t stride)
+{
+    if (lin_format_compile(af->specs, 2, spec) != 2)
+        return false;
+
+    const struct lin_format_spec *conv = &af->specs[0];
+    bool is_float = elem_type == LIN_ELEM_FLOAT || elem_type == LIN_ELEM_DOUBLE;
+    if (conv->type != TYPE_NONE ||
+        (conv->flags & (FLAGS_WIDTH_ARG | FLAGS_PREC_ARG)) ||
+        !strchr(is_float ? "fFeEgGaAvV" : "diuxXob", conv->conv))
+        return false;
+
+    unsigned int flags = conv->flags;
+    if (flags & FLAGS_LEFT)
+        flags &= ~FLAGS_ZEROPAD;
+
+    af->sep = sep;
+    af->sep_len = strlen(sep);
+    af->elem_type = elem_type;
+    af->stride = stride;
+    af->flags = flags;
+    af->is_float = is_float;
+    // Plain "%d"/"%u" elements are written directly if the longest possible
+    // element fits (this is the common case for dumping integer columns).
+    af->plain = !is_float && conv->conv != 'x' && conv->conv != 'X' &&
+                conv->conv != 'o' && conv->conv != 'b' && !flags &&
+                !conv->width && conv->prec < 0;
+    af->plain_max = conv->text_len + 21 + af->specs[1].text_len + af->sep_len;
+    return true;
+}
+
+// Output count elements starting at elem, each followed by the separator,
+// except the last one if !sep_last. Unless measure is set, stop before the
+// first element that doesn't fit completely. Returns the number of elements
+// output, or -1 on error.
+static ptrdiff_t format_elems(struct buf *buf, const struct array_fmt *af,
+                              const char *elem, size_t count, bool sep_last,
+                              bool measure)
+{
+    const struct lin_format_spec *conv = &af->specs[0];
+    const struct lin_format_spec *suffix = &af->specs[1];
+    size_t n;
+
+    for (n = 0; n < count; n++, elem += af->stride) {
+        char *start = buf->dst;
+        size_t start_idx = buf->idx;
+        bool sep = sep_last || n + 1 < count;
+
+        if (af->is_float) {
+            double val;
+            if (af->elem_type == LIN_ELEM_FLOAT) {
+                float f;
+                memcpy(&f, elem, sizeof(f));
+                val = f;
+            } else {
+                memcpy(&val, elem, sizeof(val));
+            }
+            out(buf, conv->text, conv->text_len);
+            if (fmt_fp(buf, val, conv->width, conv->prec, af->flags,
+                       conv->conv) < 0)
+            {
+                buf->dst = start;
+                return -1;
+            }
+        } else {
+            uint64_t val;
+            bool negative = false;
+            if (af->elem_type == LIN_ELEM_INT32 ||
+                af->elem_type == LIN_ELEM_UINT32)
+            {
+                uint32_t v;
+                memcpy(&v, elem, sizeof(v));
+                negative = af->elem_type == LIN_ELEM_INT32 && (v >> 31);
+                val = v;
+            } else {
+                memcpy(&val, elem, sizeof(val));
+                negative = af->elem_type == LIN_ELEM_INT64 && (val >> 63);
+            }
+            // Signed conversions print the value; others reinterpret signed
+            // elements as unsigned (like printf() does).
+            if (conv->conv != 'd' && conv->conv != 'i') {
+                negative = false;
+            } else if (negative) {
+                val = af->elem_type == LIN_ELEM_INT32 ? -(uint32_t)val : -val;
+            }
+            if (af->plain && buf->end - buf->dst >= af->plain_max) {
+                char *d = buf->dst;
+                memcpy(d, conv->text, conv->text_len);
+                d += conv->text_len;
+                *d = '-';
+                d += negative;
+                int len = count_digits(val, 10);
+                write_dec(d, len, val);
+                d += len;
+                memcpy(d, suffix->text, suffix->text_len);
+                d += suffix->text_len;
+                if (sep) {
+                    memcpy(d, af->sep, af->sep_len);
+                    d += af->sep_len;
+                }
+                out_commit(buf, d - buf->dst);
+                continue;
+            }
+            out(buf, conv->text, conv->text_len);
+            format_int(buf, conv->conv, val, 0, negative, conv->prec,
+                       conv->width, af->flags);
+        }
+
+        out(buf, suffix->text, suffix->text_len);
+        if (sep)
+            out(buf, af->sep, af->sep_len);
+
+        // Drop the partially written element if the buffer is full.
+        if (!measure && buf->idx - start_idx != buf->dst - start) {
+            buf->dst = start;
+            buf->idx = start_idx;
+            break;
+        }
+    }
+
+    return n;
+}
+
+ptrdiff_t lin_format_array(char *dst, size_t size, const char *spec,
+                           const char *sep, enum lin_elem_type elem_type,
+                           const void *ptr, size_t count, size_t stride)
+{
+    struct array_fmt af;
+
+    if (!array_fmt_init(&af, spec, sep, elem_type, stride))
+        return -1;
+
+    struct buf buf = {
+        .dst = dst,
+        // (Always reserve 1 byte for the \0 if there's space.)
+        .end = size ? dst + size - 1 : dst,
+    };
+
+    ptrdiff_t n = format_elems(&buf, &af, ptr, count, false, false);
+
+    if (size)
+        buf.dst[0] = '\0';
+
+    return n;
+}
+
+// State shared by the tasks of lin_format_array_par().
+struct array_task {
+    const struct array_fmt *af;
+    const char *ptr;
+    size_t count;
+    size_t chunk_size;
+    size_t *chunk_lens;     // lengths after measuring, offsets for writing
+    char *dst;
+};
+
+static void array_measure_task(void *ctx, size_t i)
+{
+    struct array_task *t = ctx;
+    size_t first = i * t->chunk_size;
+    size_t n = MIN(t->chunk_size, t->count - first);
+    struct buf buf = {0};
+
+    if (format_elems(&buf, t->af, t->ptr + first * t->af->stride, n,
+                     first + n < t->count, true) < 0 || buf.overflow)
+        buf.idx = SIZE_MAX;
+    t->chunk_lens[i] = buf.idx;
+}
+
+static void array_write_task(void *ctx, size_t i)
+{
+    struct array_task *t = ctx;
+    size_t first = i * t->chunk_size;
+    size_t n = MIN(t->chunk_size, t->count - first);
+    // (The chunk's output ends where the next one starts.)
+    struct buf buf = {
+        .dst = t->dst + t->chunk_lens[i],
+        .end = t->dst + t->chunk_lens[i + 1],
+    };
+
+    format_elems(&buf, t->af, t->ptr + first * t->af->stride, n,
+                 first + n < t->count, false);
+}
+
+ptrdiff_t lin_format_array_par(char *dst, size_t size, const char *spec,
+                               const char *sep, enum lin_elem_type elem_type,
+                               const void *ptr, size_t count, size_t stride,
+                               size_t chunk_size, size_t *chunk_lens,
+                               lin_executor exec, void *exec_ctx)
+{
+    struct array_fmt af;
+
+    if (!array_fmt_init(&af, spec, sep, elem_type, stride) || !chunk_size)
+        return -1;
+
+    size_t num_chunks = count / chunk_size + !!(count % chunk_size);
+    struct array_task t = {
+        .af = &af,
+        .ptr = ptr,
+        .count = count,
+        .chunk_size = chunk_size,
+        .chunk_lens = chunk_lens,
+        .dst = dst,
+    };
+
+    exec(exec_ctx, array_measure_task, &t, num_chunks);
+
+    // Turn the lengths into offsets, for all chunks that fit completely.
+    size_t avail = size ? size - 1 : 0;
+    size_t pos = 0;
+    size_t full = 0;
+    for (; full < num_chunks; full++) {
+        size_t len = chunk_lens[full];
+        if (len == SIZE_MAX) {
+            if (size)
+                dst[pos] = '\0';
+            return -1;
+        }
+        if (len > avail - pos)
+            break;
+        chunk_lens[full] = pos;
+        pos += len;
+    }
+    chunk_lens[full] = pos;
+
+    if (full)
+        exec(exec_ctx, array_write_task, &t, full);
+
+    // Fill the rest of dst (as much of the next chunk as fits).
+    ptrdiff_t n = MIN(full * chunk_size, count);
+    if (n < count) {
+        struct buf buf = {
+            .dst = dst + pos,
+            .end = dst + avail,
+        };
+        ptrdiff_t r = format_elems(&buf, &af, (const char *)ptr + n * stride,
+                                   count - n, false, false);
+        pos = buf.dst - dst;
+        n = r < 0 ? r : n + r;
+    }
+
+    if (size)
+        dst[pos] = '\0';
+
+    return n;
+}
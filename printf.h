@@ -2,6 +2,12 @@
 #define LIN_PRINTF_H_
 
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 // snprintf()-like function. Should be mostly C11 compliant, except:
 //  - Does not support the following conversion specifiers: n
@@ -18,6 +24,29 @@
 //  - Locale independent (always uses "C" locale).
 //  - Supports the conversion specifier 'b' for binary number output.
 //  - str is _always_ 0-terminated (unless size==0).
+//  - Supports the conversion specifiers 'v' and 'V' for double. They output
+//    the shortest digit string that parses back to the same value (e.g. with
+//    lin_strtod()). The notation is chosen like with "%.17g", but trailing
+//    zeros are never printed. Precision is ignored; flags and width work like
+//    with 'g'. Much faster than "%.17g".
+//  - Supports the conversion specifier 'D' for fixed-point decimals. It takes
+//    two arguments: int scale, and a signed integer val (with the same length
+//    modifiers as 'd'), and prints the exact value val * 10^-scale. scale must
+//    be in [0, 19]. Precision is the number of digits after the radix point
+//    (default: scale), excess digits are rounded to nearest, ties to even.
+//    Flags and width work like with 'f'. E.g. ("%I64D", 2, (int64_t)-12345)
+//    outputs "-123.45". No floating point is involved.
+//  - Supports the conversion specifier 'q' for quoted strings. It takes a
+//    const char* like 's', and outputs it in double quotes, escaped as C string
+//    literal (\" \\ \n \t etc., \ooo for other control characters and 0x7F), or
+//    with the '#' flag as JSON string (\u00xx for other control characters).
+//    Bytes >= 0x80 are copied as they are. Precision limits the number of input
+//    bytes read; width and '-' work like with 's'.
+//  - Supports the conversion specifier 'H' for hex dumps. It takes a pointer
+//    (const void*) and outputs the bytes it points to as 2 hex digits each. The
+//    number of bytes must be passed as precision, e.g. ("%.*H", 4, data). The
+//    ' ' flag separates bytes with a space, and '#' uses uppercase letters;
+//    width and '-' work like with 's'.
 //  - Length modifier for explicitly sized integer types:
 //      I64u => uint64_t
 //      I64d =>  int64_t
@@ -30,6 +59,10 @@
 //      Iu   => size_t
 //      Id   => ptrdiff_t
 //    (I32, I64 and I are compatible with Microsoft extensions)
+//      I128u => unsigned __int128
+//      I128d =>          __int128
+//    (I128 only if the compiler supports __int128, and not with 'D',
+//    lin_snprintf_args() or printf.hpp)
 //  - Limited support for %r. %r works like a recursive, inline vsnprintf().
 //    it takes two arguments: const char* (format), LIN_VA_LIST (args).
 //    LIN_VA_LIST is a wrapped va_list (because va_list can be an array type).
@@ -46,10 +79,291 @@ int lin_snprintf(char *str, size_t size, const char *format, ...);
 // See lin_snprintf().
 int lin_vsnprintf(char *str, size_t size, const char *format, va_list ap);
 
+// Like lin_snprintf(), but stop formatting as soon as the output is known to
+// be truncated, instead of computing the full length. Returns the output
+// length if it fit, and size if it was truncated, so that ret >= size checks
+// for truncation in both cases. (With size==0, it's the same as lin_snprintf().)
+// This bounds the time spent on, for example, a long %s or a huge width or
+// precision with a small buffer.
+__attribute__((format(printf, 3, 4)))
+int lin_snprintf_trunc(char *str, size_t size, const char *format, ...);
+
+// See lin_snprintf_trunc().
+int lin_vsnprintf_trunc(char *str, size_t size, const char *format, va_list ap);
+
+// Return the length of the output of lin_snprintf() for the same arguments
+// (including -1 for errors), i.e. this is the same as lin_snprintf(NULL, 0, ..).
+// Integer and string lengths are computed without generating the output, and
+// floats avoid the slow exact expansion for large precisions where possible.
+// (lin_snprintf() does the same with size==0, or once the output has been
+// truncated.)
+__attribute__((format(printf, 1, 2)))
+int lin_format_len(const char *format, ...);
+
+// See lin_format_len().
+int lin_vformat_len(const char *format, va_list ap);
+
+// Write the digits of v in the given base (2, 8, 10 or 16, with lowercase
+// letters) to dst[0..size), like "%llu" etc. without any flags, but without
+// format parsing. Nothing else is written (no 0 terminator). Returns the
+// number of chars written, or -1 if they don't fit into size or base is not
+// supported (nothing is written then). At most LIN_TOA_MAX chars are written.
+int lin_u64toa(char *dst, size_t size, uint64_t v, unsigned int base);
+
+// Like lin_u64toa(), but prefix negative values with '-' (in all bases).
+int lin_i64toa(char *dst, size_t size, int64_t v, unsigned int base);
+
+// Like lin_u64toa().
+int lin_u32toa(char *dst, size_t size, uint32_t v, unsigned int base);
+
+// Maximum number of chars written by lin_u64toa() etc. (INT64_MIN in base 2).
+#define LIN_TOA_MAX 65
+
+// How a floating point conversion was done (see struct lin_conv_info).
+enum lin_fp_path {
+    LIN_FP_NONE,        // not a floating point conversion
+    LIN_FP_SPECIAL,     // inf or nan
+    LIN_FP_SHORTEST,    // 'v' and 'V' (Ryu)
+    LIN_FP_FIXED,       // exact 64 bit fast path (precision <= 17)
+    LIN_FP_LENGTH,      // output discarded, only the length was computed
+    LIN_FP_HEX,         // 'a' and 'A'
+    LIN_FP_BIGNUM,      // exact bignum expansion
+};
+
+// Statistics about a single conversion, passed to lin_printf_hooks.conv.
+struct lin_conv_info {
+    char conv;              // conversion specifier ('d', 'f', '%', ...)
+    size_t bytes;           // output length, including padding
+    size_t pad_bytes;       // spaces or zeros added for the field width
+    enum lin_fp_path fp_path;
+    size_t bignum_passes;   // multiplications to scale the bignum (for
+                            // LIN_FP_BIGNUM)
+};
+
+// Hooks for lin_vsnprintf_ex().
+struct lin_printf_hooks {
+    // Called after each conversion. For %r, the conversions of the nested
+    // format are reported first, and the %r itself includes their output.
+    void (*conv)(void *ctx, const struct lin_conv_info *info);
+    void *ctx;              // passed to conv as is
+};
+
+// Like lin_vsnprintf(), but report each conversion to hooks (which can be
+// NULL). This is for finding out which conversions take time in a program.
+// The hooks are only called if printf.c is compiled with LIN_PRINTF_HOOKS=1;
+// otherwise they are ignored, and the library contains no hook code at all.
+int lin_vsnprintf_ex(char *str, size_t size,
+                     const struct lin_printf_hooks *hooks, const char *format,
+                     va_list ap);
+
+// Output callback for lin_cbprintf(). Receives the formatted output in chunks
+// of len bytes (the data is not 0-terminated, and len is never 0).
+typedef void (*lin_printf_cb)(void *ctx, const char *data, size_t len);
+
+// Like lin_snprintf(), but instead of writing to a buffer, pass the output to
+// cb in chunks. The output is staged in a small internal buffer, so large
+// output can be streamed to sockets, hashers etc. without having to format it
+// into a buffer of the full size first. ctx is passed to cb as is.
+// Returns the number of bytes passed to cb, or -1 on error (as
+// lin_snprintf()). Even on error, all output is passed to cb.
+__attribute__((format(printf, 3, 4)))
+int lin_cbprintf(lin_printf_cb cb, void *ctx, const char *format, ...);
+
+// See lin_cbprintf().
+int lin_vcbprintf(lin_printf_cb cb, void *ctx, const char *format, va_list ap);
+
+// A memory range for lin_format_iov(). Has the same members as POSIX struct
+// iovec, so an array of it can be passed to writev() on common platforms.
+struct lin_iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+
+// Like lin_snprintf(), but describe the output as a list of memory ranges for
+// writev() or similar. Generated text (literals, digits, padding etc.) is
+// written to scratch[0..scratch_size), while %s arguments of at least ref_min
+// bytes (after applying the precision) are not copied: their entries point to
+// the argument's memory, which must stay valid as long as iov is used. On
+// entry, *iov_count is the number of entries in iov; on return, the number of
+// entries used. No entry has iov_len==0, and no 0 terminator is written.
+// Returns the full output length (as lin_snprintf()). If scratch or iov are
+// too small, the output is truncated; then the iov_len sum is less than that.
+__attribute__((format(printf, 6, 7)))
+int lin_format_iov(struct lin_iovec *iov, size_t *iov_count, char *scratch,
+                   size_t scratch_size, size_t ref_min, const char *format, ...);
+
+// See lin_format_iov().
+int lin_vformat_iov(struct lin_iovec *iov, size_t *iov_count, char *scratch,
+                    size_t scratch_size, size_t ref_min, const char *format,
+                    va_list ap);
+
+// String builder for lin_strbuf_printf(). Initialize with e.g.
+//  struct lin_strbuf sb = { .realloc_cb = my_realloc, .ctx = my_ctx };
+// str can also be initialized to memory allocated with realloc_cb (size
+// being its allocated size, and len the length of the string in it).
+struct lin_strbuf {
+    char *str;          // 0-terminated result (NULL if size==0)
+    size_t len;         // strlen(str)
+    size_t size;        // allocated size of str
+    // Called to grow or free str. Must work like realloc(ptr, size), except
+    // that for size==0 it frees ptr. Return NULL on failure.
+    void *(*realloc_cb)(void *ctx, void *ptr, size_t size);
+    void *ctx;          // passed to realloc_cb
+};
+
+// Append formatted output (as lin_snprintf()) to sb->str, growing it with
+// sb->realloc_cb if needed. Each conversion is formatted exactly once, even
+// if the buffer has to grow in the middle of it.
+// Returns the number of bytes appended, or -1 on allocation failure or if
+// lin_snprintf() would fail. On failure, sb->len and the contents of sb->str
+// are unchanged (but sb->str might have been reallocated).
+__attribute__((format(printf, 2, 3)))
+int lin_strbuf_printf(struct lin_strbuf *sb, const char *format, ...);
+
+// See lin_strbuf_printf().
+int lin_strbuf_vprintf(struct lin_strbuf *sb, const char *format, va_list ap);
+
+// Free sb->str and reset sb to an empty string.
+void lin_strbuf_free(struct lin_strbuf *sb);
+
 struct lin_va_list {
     va_list *ap;
 };
 
 #define LIN_VA_LIST(x) ((struct lin_va_list){&(x)})
 
+// A parsed part of a format string: literal text followed by a conversion
+// specification. See lin_format_compile(). The members are private.
+struct lin_format_spec {
+    const char *text;
+    size_t text_len;
+    int width;
+    int prec;
+    unsigned int flags;
+    unsigned char type;
+    char conv;
+};
+
+// Parse a format string for lin_snprintf_compiled(). The result is written to
+// specs[0..num_specs), one entry per conversion specification (plus one for
+// the trailing text). Returns the number of entries needed; if this is larger
+// than num_specs, specs contains an incomplete result that must not be used.
+// Returns -1 if the format string is invalid.
+// Never needs more entries than the number of '%' in the format string + 1.
+// The result references the format string, which must stay valid as long as
+// the result is used. Nothing is allocated; specs is owned by the caller.
+int lin_format_compile(struct lin_format_spec *specs, size_t num_specs,
+                       const char *format);
+
+// Like lin_snprintf(), but uses a format string preparsed by
+// lin_format_compile(). This avoids parsing the format on every call.
+int lin_snprintf_compiled(char *str, size_t size,
+                          const struct lin_format_spec *specs, ...);
+
+// See lin_snprintf_compiled().
+int lin_vsnprintf_compiled(char *str, size_t size,
+                           const struct lin_format_spec *specs, va_list ap);
+
+// Values of lin_format_spec.flags and .type. Like the members, these are not a
+// stable interface; they are public only for printf.hpp, which builds
+// lin_format_spec arrays at compile time.
+#define LIN_SPEC_ZEROPAD    (1U << 0U)
+#define LIN_SPEC_LEFT       (1U << 1U)
+#define LIN_SPEC_PLUS       (1U << 2U)
+#define LIN_SPEC_SPACE      (1U << 3U)
+#define LIN_SPEC_HASH       (1U << 4U)
+#define LIN_SPEC_WIDTH_ARG  (1U << 12U)
+#define LIN_SPEC_PREC_ARG   (1U << 13U)
+
+enum {
+    LIN_SPEC_TYPE_NONE,     // (no length modifier)
+    LIN_SPEC_TYPE_CHAR,     // hh, I8
+    LIN_SPEC_TYPE_SHORT,    // h, I16
+    LIN_SPEC_TYPE_LONG,     // l
+    LIN_SPEC_TYPE_LLONG,    // ll
+    LIN_SPEC_TYPE_INTMAX,   // j
+    LIN_SPEC_TYPE_SIZE,     // z, t, I
+    LIN_SPEC_TYPE_PTR,      // (internal)
+    LIN_SPEC_TYPE_I32,      // I32
+    LIN_SPEC_TYPE_I64,      // I64
+    LIN_SPEC_TYPE_I128,     // I128
+};
+
+// An argument for lin_snprintf_args(). The member used depends on the
+// conversion:
+//  i: d i c D (value and scale), and '*' width/precision
+//  u: u x X o b
+//  d: f F e E g G a A v V
+//  s: s q
+//  p: p H
+// Integer values must be in range of the type given by the length modifier.
+union lin_format_arg {
+    intmax_t i;
+    uintmax_t u;
+    double d;
+    const char *s;
+    const void *p;
+};
+
+// Like lin_snprintf_compiled(), but the arguments are passed as array instead
+// of a va_list, one entry per argument lin_snprintf() would take. This is the
+// backend of printf.hpp. %r and I128 are not supported and are output as error.
+int lin_snprintf_args(char *str, size_t size,
+                      const struct lin_format_spec *specs,
+                      const union lin_format_arg *args);
+
+// Element types for lin_format_array().
+enum lin_elem_type {
+    LIN_ELEM_INT32,     // int32_t
+    LIN_ELEM_UINT32,    // uint32_t
+    LIN_ELEM_INT64,     // int64_t
+    LIN_ELEM_UINT64,    // uint64_t
+    LIN_ELEM_FLOAT,     // float
+    LIN_ELEM_DOUBLE,    // double
+};
+
+// Format count elements of an array, and write them to dst, separated by the
+// string sep (not after the last element). The element i is read from
+// (char *)ptr + i * stride, and its type is given by elem_type.
+// spec is a format string with exactly one conversion specification (and
+// optional literal text around it), which is parsed only once. The conversion
+// must be one of "diuxXob" for integer types and "fFeEgGaAvV" for float types,
+// and can't use length modifiers or '*'. "di" print the value of any integer
+// type; the other conversions print signed integers as unsigned (like
+// printf()).
+// The result is always 0-terminated (unless size==0), and contains only
+// complete elements (each followed by sep, unless it is the last of the
+// array). Returns the number of elements written, or -1 if spec is invalid.
+// If this is less than count, dst was full: write out the result, and resume
+// with ptr advanced by that number of elements (and count reduced). Returns 0
+// if size is too small for a single element.
+ptrdiff_t lin_format_array(char *dst, size_t size, const char *spec,
+                           const char *sep, enum lin_elem_type elem_type,
+                           const void *ptr, size_t count, size_t stride);
+
+// Executor for lin_format_array_par(): call task(task_ctx, i) for every i in
+// [0, num_tasks), in any order and possibly concurrently (e.g. on a thread
+// pool), and return only after all calls have returned.
+typedef void (*lin_executor)(void *exec_ctx,
+                             void (*task)(void *task_ctx, size_t i),
+                             void *task_ctx, size_t num_tasks);
+
+// Like lin_format_array(), but the array is split into chunks of chunk_size
+// elements, which are formatted by independent tasks run with exec: first the
+// output length of each chunk is measured, then each chunk is formatted
+// directly at its final offset in dst. The result is the same as with
+// lin_format_array(), including if dst is too small. The library does not
+// create threads; exec_ctx is passed to exec as is.
+// chunk_lens is scratch space with at least count / chunk_size + 2 entries.
+// Returns -1 if spec is invalid or chunk_size is 0.
+ptrdiff_t lin_format_array_par(char *dst, size_t size, const char *spec,
+                               const char *sep, enum lin_elem_type elem_type,
+                               const void *ptr, size_t count, size_t stride,
+                               size_t chunk_size, size_t *chunk_lens,
+                               lin_executor exec, void *exec_ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,387 @@
+#ifndef LIN_PRINTF_HPP_
+#define LIN_PRINTF_HPP_
+
+// Type-safe C++20 front-end for lin_snprintf(). The format string is a
+// template argument, and is parsed at compile time:
+//
+//   char buf[80];
+//   lin::format_to<"%s: %I64d">(buf, sizeof(buf), name, value);
+//
+// An invalid format string, a wrong number of arguments, or an argument whose
+// type does not match its conversion is a compile error. The parsed format is
+// a static lin_format_spec array, which is passed with the arguments to
+// lin_snprintf_args(); no format parsing or va_list is involved at runtime.
+//
+// Arguments are checked as follows:
+//  - d i D: integer type (not bool) that converts to the type given by the
+//    length modifier without changing its value (e.g. int or short for "%d",
+//    int64_t for "%I64d", but not unsigned or long long for "%d")
+//  - u x X o b: unsigned integer type no larger than the length modifier type
+//  - c: integer type no larger than int
+//  - f F e E g G a A v V: float or double
+//  - s q: char * or const char * (or char arrays)
+//  - p H: any object pointer, or nullptr
+//    (H requires a precision, .N or .*)
+//  - '*' width/precision, and the scale argument of D: int
+// Length modifiers are rejected for c s q p H %, and allowed only as 'l' for
+// floats. %r is not supported.
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <climits>
+#include <type_traits>
+#include <utility>
+
+#include "printf.h"
+
+namespace lin {
+
+// A string literal as template argument.
+template <std::size_t N>
+struct fixed_string {
+    char str[N] = {};
+
+    constexpr fixed_string(const char (&s)[N])
+    {
+        for (std::size_t n = 0; n < N; n++)
+            str[n] = s[n];
+    }
+};
+
+namespace detail {
+
+// Which union lin_format_arg member an argument uses, and how it's checked.
+enum class arg_kind { sint, uint, chr, flt, str, ptr };
+
+struct arg_desc {
+    arg_kind kind;
+    unsigned char type; // LIN_SPEC_TYPE_*
+};
+
+// Same as parse_spec() in printf.c. Returns false for invalid specs, and for
+// specs that the C++ front-end rejects.
+constexpr bool parse_spec(const char *&format, lin_format_spec &spec)
+{
+    spec = lin_format_spec{};
+    spec.text = format;
+    while (*format && *format != '%')
+        format++;
+    spec.text_len = static_cast<std::size_t>(format - spec.text);
+    spec.prec = -1;
+    if (!*format)
+        return true;
+    format++;
+
+    for (;; format++) {
+        if (*format == '0') {
+            spec.flags |= LIN_SPEC_ZEROPAD;
+        } else if (*format == '-') {
+            spec.flags |= LIN_SPEC_LEFT;
+        } else if (*format == '+') {
+            spec.flags |= LIN_SPEC_PLUS;
+        } else if (*format == ' ') {
+            spec.flags |= LIN_SPEC_SPACE;
+        } else if (*format == '#') {
+            spec.flags |= LIN_SPEC_HASH;
+        } else {
+            break;
+        }
+    }
+
+    auto atoi = [&format]() {
+        unsigned int i = 0U;
+        while (*format >= '0' && *format <= '9')
+            i = i * 10U + static_cast<unsigned int>(*format++ - '0');
+        return i > INT_MAX ? INT_MAX : static_cast<int>(i);
+    };
+
+    if (*format == '*') {
+        spec.flags |= LIN_SPEC_WIDTH_ARG;
+        format++;
+    } else {
+        spec.width = atoi();
+    }
+
+    if (*format == '.') {
+        format++;
+        if (*format == '*') {
+            spec.flags |= LIN_SPEC_PREC_ARG;
+            format++;
+        } else {
+            spec.prec = atoi();
+        }
+    }
+
+    spec.type = LIN_SPEC_TYPE_NONE;
+    switch (*format) {
+    case 'l':
+        spec.type = LIN_SPEC_TYPE_LONG;
+        if (*++format == 'l') {
+            spec.type = LIN_SPEC_TYPE_LLONG;
+            format++;
+        }
+        break;
+    case 'h':
+        spec.type = LIN_SPEC_TYPE_SHORT;
+        if (*++format == 'h') {
+            spec.type = LIN_SPEC_TYPE_CHAR;
+            format++;
+        }
+        break;
+    case 't':
+    case 'z':
+        spec.type = LIN_SPEC_TYPE_SIZE;
+        format++;
+        break;
+    case 'j':
+        spec.type = LIN_SPEC_TYPE_INTMAX;
+        format++;
+        break;
+    case 'I':
+        if (format[1] == '6' && format[2] == '4') {
+            spec.type = LIN_SPEC_TYPE_I64;
+            format += 3;
+        } else if (format[1] == '3' && format[2] == '2') {
+            spec.type = LIN_SPEC_TYPE_I32;
+            format += 3;
+        } else if (format[1] == '1' && format[2] == '6') {
+            spec.type = LIN_SPEC_TYPE_SHORT;
+            format += 3;
+        } else if (format[1] == '8') {
+            spec.type = LIN_SPEC_TYPE_CHAR;
+            format += 2;
+        } else if (!(format[1] >= '0' && format[1] <= '9')) {
+            spec.type = LIN_SPEC_TYPE_SIZE;
+            format += 1;
+        }
+        break;
+    default:
+        break;
+    }
+
+    spec.conv = *format;
+    if (!spec.conv)
+        return false;
+    format++;
+    switch (spec.conv) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'b':
+    case 'D':
+        return true;
+    case 'f': case 'F': case 'g': case 'G': case 'e': case 'E': case 'a':
+    case 'A': case 'v': case 'V':
+        return spec.type == LIN_SPEC_TYPE_NONE ||
+               spec.type == LIN_SPEC_TYPE_LONG;
+    case 'c': case 's': case 'q': case 'p': case '%':
+        return spec.type == LIN_SPEC_TYPE_NONE;
+    case 'H':
+        // (The byte count is passed as precision, and is required.)
+        return spec.type == LIN_SPEC_TYPE_NONE &&
+               (spec.prec >= 0 || (spec.flags & LIN_SPEC_PREC_ARG));
+    default:
+        return false;
+    }
+}
+
+// Call on_spec(spec) and on_arg(arg_desc) for each parsed spec and argument.
+template <class S, class A>
+constexpr bool walk_format(const char *format, S &&on_spec, A &&on_arg)
+{
+    while (1) {
+        lin_format_spec spec;
+        if (!parse_spec(format, spec))
+            return false;
+        on_spec(spec);
+        if (!spec.conv)
+            return true;
+        if (spec.flags & LIN_SPEC_WIDTH_ARG)
+            on_arg(arg_desc{arg_kind::sint, LIN_SPEC_TYPE_NONE});
+        if (spec.flags & LIN_SPEC_PREC_ARG)
+            on_arg(arg_desc{arg_kind::sint, LIN_SPEC_TYPE_NONE});
+        arg_kind kind = arg_kind::sint;
+        switch (spec.conv) {
+        case '%':
+            continue;
+        case 'D':
+            on_arg(arg_desc{arg_kind::sint, LIN_SPEC_TYPE_NONE});
+            kind = arg_kind::sint;
+            break;
+        case 'd': case 'i':
+            kind = arg_kind::sint;
+            break;
+        case 'u': case 'x': case 'X': case 'o': case 'b':
+            kind = arg_kind::uint;
+            break;
+        case 'c':
+            kind = arg_kind::chr;
+            break;
+        case 's':
+        case 'q':
+            kind = arg_kind::str;
+            break;
+        case 'p':
+        case 'H':
+            kind = arg_kind::ptr;
+            break;
+        default:
+            kind = arg_kind::flt;
+            break;
+        }
+        on_arg(arg_desc{kind, spec.type});
+    }
+}
+
+struct format_size {
+    bool ok;
+    std::size_t num_specs;
+    std::size_t num_args;
+};
+
+template <fixed_string F>
+constexpr format_size get_format_size()
+{
+    format_size r{false, 0, 0};
+    r.ok = walk_format(F.str, [&r](const lin_format_spec &) { r.num_specs++; },
+                       [&r](const arg_desc &) { r.num_args++; });
+    return r;
+}
+
+template <std::size_t NS, std::size_t NA>
+struct parsed_format {
+    std::array<lin_format_spec, NS> specs;
+    std::array<arg_desc, NA> args;
+};
+
+// The parsed format. The specs reference the template parameter object F.
+template <fixed_string F>
+struct compiled {
+    static constexpr format_size size = get_format_size<F>();
+
+    static constexpr auto parse()
+    {
+        parsed_format<size.num_specs, size.num_args> r{};
+        if (size.ok) {
+            std::size_t ns = 0, na = 0;
+            walk_format(F.str,
+                        [&](const lin_format_spec &spec) { r.specs[ns++] = spec; },
+                        [&](const arg_desc &arg) { r.args[na++] = arg; });
+        }
+        return r;
+    }
+
+    static constexpr parsed_format<size.num_specs, size.num_args> format = parse();
+};
+
+template <unsigned char type>
+constexpr std::size_t int_size()
+{
+    switch (type) {
+    case LIN_SPEC_TYPE_CHAR:    return sizeof(char);
+    case LIN_SPEC_TYPE_SHORT:   return sizeof(short);
+    case LIN_SPEC_TYPE_LONG:    return sizeof(long);
+    case LIN_SPEC_TYPE_LLONG:   return sizeof(long long);
+    case LIN_SPEC_TYPE_INTMAX:  return sizeof(std::intmax_t);
+    case LIN_SPEC_TYPE_SIZE:    return sizeof(std::size_t);
+    case LIN_SPEC_TYPE_I32:     return sizeof(std::int32_t);
+    case LIN_SPEC_TYPE_I64:     return sizeof(std::int64_t);
+    default:                    return sizeof(int);
+    }
+}
+
+template <class T>
+constexpr bool is_int = std::is_integral_v<T> && !std::is_same_v<T, bool>;
+
+template <arg_desc D, class T>
+constexpr bool arg_ok()
+{
+    using U = std::remove_cv_t<std::decay_t<T>>;
+    constexpr std::size_t size = int_size<D.type>();
+    if constexpr (D.kind == arg_kind::sint) {
+        if constexpr (is_int<U>) {
+            return std::is_signed_v<U> ? sizeof(U) <= size : sizeof(U) < size;
+        } else {
+            return false;
+        }
+    } else if constexpr (D.kind == arg_kind::uint) {
+        return is_int<U> && std::is_unsigned_v<U> && sizeof(U) <= size;
+    } else if constexpr (D.kind == arg_kind::chr) {
+        return is_int<U> && sizeof(U) <= sizeof(int);
+    } else if constexpr (D.kind == arg_kind::flt) {
+        return std::is_same_v<U, float> || std::is_same_v<U, double>;
+    } else if constexpr (D.kind == arg_kind::str) {
+        return std::is_same_v<U, char *> || std::is_same_v<U, const char *>;
+    } else {
+        return std::is_null_pointer_v<U> ||
+               (std::is_pointer_v<U> &&
+                !std::is_function_v<std::remove_pointer_t<U>>);
+    }
+}
+
+template <fixed_string F, class... Args, std::size_t... I>
+constexpr bool args_ok(std::index_sequence<I...>)
+{
+    constexpr auto &format = compiled<F>::format;
+    return (arg_ok<format.args[I], Args>() && ...);
+}
+
+template <arg_kind K, class T>
+lin_format_arg to_arg(const T &v)
+{
+    lin_format_arg a{};
+    if constexpr (K == arg_kind::sint || K == arg_kind::chr) {
+        a.i = static_cast<std::intmax_t>(v);
+    } else if constexpr (K == arg_kind::uint) {
+        a.u = static_cast<std::uintmax_t>(v);
+    } else if constexpr (K == arg_kind::flt) {
+        a.d = v;
+    } else if constexpr (K == arg_kind::str) {
+        a.s = v;
+    } else if constexpr (std::is_null_pointer_v<T>) {
+        a.p = nullptr;
+    } else {
+        a.p = const_cast<const void *>(static_cast<const volatile void *>(v));
+    }
+    return a;
+}
+
+template <fixed_string F, class... Args, std::size_t... I>
+int format_to(char *dst, std::size_t size, std::index_sequence<I...>,
+              const Args &...args)
+{
+    constexpr auto &format = compiled<F>::format;
+    // (Extra entry, because arrays can't be empty.)
+    const lin_format_arg arr[] = {to_arg<format.args[I].kind>(args)..., {}};
+    return lin_snprintf_args(dst, size, format.specs.data(), arr);
+}
+
+} // namespace detail
+
+// Whether format_to<F>() accepts arguments of the given types.
+template <fixed_string F, class... Args>
+constexpr bool format_ok = [] {
+    constexpr auto size = detail::compiled<F>::size;
+    if constexpr (!size.ok || size.num_args != sizeof...(Args)) {
+        return false;
+    } else {
+        return detail::args_ok<F, Args...>(std::index_sequence_for<Args...>{});
+    }
+}();
+
+// Like lin_snprintf(dst, size, F, args...), with F parsed and checked at
+// compile time. See the top of this file.
+template <fixed_string F, class... Args>
+int format_to(char *dst, std::size_t size, const Args &...args)
+{
+    constexpr auto fsize = detail::compiled<F>::size;
+    static_assert(fsize.ok, "invalid format string");
+    static_assert(fsize.num_args == sizeof...(Args),
+                  "wrong number of arguments for format string");
+    static_assert(format_ok<F, Args...>,
+                  "argument type does not match format string");
+    return detail::format_to<F>(dst, size, std::index_sequence_for<Args...>{},
+                                args...);
+}
+
+} // namespace lin
+
+#endif
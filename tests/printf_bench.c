@@ -0,0 +1,321 @@
+// Throughput benchmark for lin_snprintf(), compared to the system snprintf().
+// Usage: ./printf_bench [-csv] [iterations] [name-prefix]
+// Prints ns/call and output MB/s per benchmark and implementation. With -csv,
+// prints "name,impl,ns_per_call,mb_per_s" lines instead, for tracking
+// regressions. Benchmarks using extensions only run with lin_snprintf().
+
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "printf.h"
+
+typedef int (*snprintf_type)(char *str, size_t size, const char *format, ...);
+
+static char out_buf[4096];
+
+// Varying inputs, indexed with the iteration number.
+static const int ints_small[8] = {0, 7, 42, -5, 99, 12, -1, 8};
+static const int ints_large[8] = {
+    INT_MIN, 1234567890, -987654321, INT_MAX, 2000000000, -1, 55555555, 7,
+};
+static const unsigned long long u64s[8] = {
+    ULLONG_MAX, 0x123456789abcdefULL, 42, 10000000000000000000ULL,
+    0xdeadbeefULL, 1ULL << 40, 999999999999ULL, 0,
+};
+static const double doubles[8] = {
+    0.1, 3.141592653589793, 1e100, -2.5e-7, 123456.789, 1.0 / 3, 6.02214076e23,
+    -0.0,
+};
+static const double doubles_extreme[8] = {
+    1e300, -2.5e-300, 1.7976931348623157e308, 4.9e-324, 6.02214076e250,
+    1.5e-200, 2.2250738585072014e-308, 123e280,
+};
+static const char *strs[8] = {
+    "a", "hello", "lin_snprintf", "", "The quick brown fox", "x", "12345", "abc",
+};
+
+static int bench_int_small(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%d", ints_small[i & 7]);
+}
+
+static int bench_int_large(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%d", ints_large[i & 7]);
+}
+
+static int bench_int_u64(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%llu", u64s[i & 7]);
+}
+
+// lin_u64toa() without the format string, for comparison with int_u64
+static int bench_u64toa(snprintf_type f, long i)
+{
+    (void)f;
+    return lin_u64toa(out_buf, sizeof(out_buf), u64s[i & 7], 10);
+}
+
+static int bench_int_mixed(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%d %5d %-8d %08d %+d", ints_small[i & 7],
+             ints_large[i & 7], ints_small[(i + 1) & 7], ints_large[(i + 3) & 7],
+             ints_small[(i + 5) & 7]);
+}
+
+static int bench_hex(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%#llx", u64s[i & 7]);
+}
+
+static int bench_octal(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%llo", u64s[i & 7]);
+}
+
+static int bench_binary(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%llb", u64s[i & 7]);
+}
+
+static int bench_str(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%s", strs[i & 7]);
+}
+
+static int bench_str_pad(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%-20s|%20s|%.3s", strs[i & 7],
+             strs[(i + 1) & 7], strs[(i + 2) & 7]);
+}
+
+static int bench_str_quoted(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%#q", strs[i & 7]);
+}
+
+static int bench_f(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%f", doubles[i & 7]);
+}
+
+static int bench_f2(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%.2f", doubles[i & 7]);
+}
+
+static int bench_f17(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%.17f", doubles[i & 7]);
+}
+
+static int bench_f40(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%.40f", doubles[i & 7]);
+}
+
+static int bench_e(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%e", doubles[i & 7]);
+}
+
+static int bench_e3(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%.3e", doubles[i & 7]);
+}
+
+static int bench_e17(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%.17e", doubles[i & 7]);
+}
+
+static int bench_g(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%g", doubles[i & 7]);
+}
+
+static int bench_g17(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%.17g", doubles[i & 7]);
+}
+
+static int bench_f_extreme(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%f", doubles_extreme[i & 7]);
+}
+
+static int bench_e_extreme(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%.17e", doubles_extreme[i & 7]);
+}
+
+static int bench_f300(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%.300f", doubles_extreme[i & 7]);
+}
+
+static int bench_a(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%a", doubles[i & 7]);
+}
+
+static int bench_v(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%v", doubles[i & 7]);
+}
+
+static int bench_fixed(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%I64D", 2, (int64_t)u64s[i & 7]);
+}
+
+#ifdef __SIZEOF_INT128__
+static int bench_i128(snprintf_type f, long i)
+{
+    unsigned __int128 v = (unsigned __int128)u64s[i & 7] << 64 | u64s[(i + 1) & 7];
+    return f(out_buf, sizeof(out_buf), "%I128u", v);
+}
+#endif
+
+static int bench_hexdump(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf), "%.*H", 32 + (int)(i & 7), u64s);
+}
+
+static int nested_r(snprintf_type f, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int r = f(out_buf, sizeof(out_buf), "[%s] %r", "log", fmt, LIN_VA_LIST(ap));
+    va_end(ap);
+    return r;
+}
+
+static int bench_r(snprintf_type f, long i)
+{
+    return nested_r(f, "%d: %s", ints_large[i & 7], strs[i & 7]);
+}
+
+static int bench_literal_long(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf),
+        "HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=utf-8\r\n"
+        "Cache-Control: no-cache, no-store, must-revalidate\r\n"
+        "Connection: keep-alive\r\nServer: lin\r\nContent-Length: %d\r\n"
+        "X-Frame-Options: SAMEORIGIN\r\nX-Content-Type-Options: nosniff\r\n"
+        "Strict-Transport-Security: max-age=31536000; includeSubDomains\r\n"
+        "\r\n", ints_large[i & 7]);
+}
+
+static int bench_literal_only(snprintf_type f, long i)
+{
+    (void)i;
+    return f(out_buf, sizeof(out_buf),
+        "The quick brown fox jumps over the lazy dog. The quick brown fox "
+        "jumps over the lazy dog. The quick brown fox jumps over the lazy "
+        "dog. The quick brown fox jumps over the lazy dog.\n");
+}
+
+static int bench_literal_mixed(snprintf_type f, long i)
+{
+    return f(out_buf, sizeof(out_buf),
+        "[%s] request from %s took %d ms (%u bytes in, %u bytes out), "
+        "status %d, user agent \"%s\"\n", "info", "192.168.0.1",
+        ints_small[i & 7], 512u, 8192u, 200, "Mozilla/5.0 (X11; Linux x86_64)");
+}
+
+static const struct {
+    const char *name;
+    int (*fn)(snprintf_type f, long i);
+    int lin_only;   // uses extensions the system snprintf() may not support
+} benchmarks[] = {
+    {"int_small",      bench_int_small,      0},
+    {"int_large",      bench_int_large,      0},
+    {"int_u64",        bench_int_u64,        0},
+    {"u64toa",         bench_u64toa,         1},
+    {"int_mixed",      bench_int_mixed,      0},
+    {"hex",            bench_hex,            0},
+    {"octal",          bench_octal,          0},
+    {"binary",         bench_binary,         1},
+    {"str",            bench_str,            0},
+    {"str_pad",        bench_str_pad,        0},
+    {"str_quoted",     bench_str_quoted,     1},
+    {"float_f",        bench_f,              0},
+    {"float_f2",       bench_f2,             0},
+    {"float_f17",      bench_f17,            0},
+    {"float_f40",      bench_f40,            0},
+    {"float_e",        bench_e,              0},
+    {"float_e3",       bench_e3,             0},
+    {"float_e17",      bench_e17,            0},
+    {"float_g",        bench_g,              0},
+    {"float_g17",      bench_g17,            0},
+    {"float_f_ext",    bench_f_extreme,      0},
+    {"float_e_ext",    bench_e_extreme,      0},
+    {"float_f300_ext", bench_f300,           0},
+    {"float_a",        bench_a,              0},
+    {"float_v",        bench_v,              1},
+    {"fixed_D",        bench_fixed,          1},
+    {"hexdump",        bench_hexdump,        1},
+#ifdef __SIZEOF_INT128__
+    {"int_i128",       bench_i128,           1},
+#endif
+    {"nested_r",       bench_r,              1},
+    {"literal_long",   bench_literal_long,   0},
+    {"literal_only",   bench_literal_only,   0},
+    {"literal_mixed",  bench_literal_mixed,  0},
+};
+
+static const struct {
+    const char *name;
+    snprintf_type fn;
+} impls[] = {
+    {"lin",    lin_snprintf},
+    {"system", snprintf},
+};
+
+int main(int argc, char **argv)
+{
+    int csv = 0;
+    if (argc > 1 && !strcmp(argv[1], "-csv")) {
+        csv = 1;
+        argc--;
+        argv++;
+    }
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    const char *filter = argc > 2 ? argv[2] : "";
+
+    if (csv)
+        printf("name,impl,ns_per_call,mb_per_s\n");
+    else
+        printf("%-16s %-8s %12s %10s\n", "name", "impl", "ns/call", "MB/s");
+
+    for (size_t n = 0; n < sizeof(benchmarks) / sizeof(benchmarks[0]); n++) {
+        if (strncmp(benchmarks[n].name, filter, strlen(filter)))
+            continue;
+        for (size_t m = 0; m < sizeof(impls) / sizeof(impls[0]); m++) {
+            if (m > 0 && benchmarks[n].lin_only)
+                continue;
+            long long bytes = 0;
+            clock_t start = clock();
+            for (long i = 0; i < iterations; i++)
+                bytes += benchmarks[n].fn(impls[m].fn, i);
+            double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+            double ns = secs / iterations * 1e9;
+            double mbs = secs > 0 ? bytes / secs / 1e6 : 0;
+            if (csv) {
+                printf("%s,%s,%.2f,%.1f\n", benchmarks[n].name, impls[m].name,
+                       ns, mbs);
+            } else {
+                printf("%-16s %-8s %12.1f %10.1f\n", benchmarks[n].name,
+                       impls[m].name, ns, mbs);
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,125 @@
+// Tests for the C++ front-end in printf.hpp.
+
+#undef NDEBUG
+
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "printf.hpp"
+
+#define REQUIRE_STR_EQ(got, expect) do {            \
+    if (std::strcmp(got, expect)) {                 \
+        std::printf("Got:      '%s'\n", got);       \
+        std::printf("Expected: '%s'\n", expect);    \
+    }                                               \
+    assert(!std::strcmp(got, expect));              \
+} while (0)
+
+// Compile-time checks.
+static_assert(lin::format_ok<"no args">);
+static_assert(lin::format_ok<"%d %s", int, const char *>);
+static_assert(lin::format_ok<"%d", short>);
+static_assert(lin::format_ok<"%d", unsigned char>);
+static_assert(lin::format_ok<"%u", unsigned char>);
+static_assert(lin::format_ok<"%I64d %I64x", std::int64_t, std::uint64_t>);
+static_assert(lin::format_ok<"%zu %p %p", std::size_t, int *, std::nullptr_t>);
+static_assert(lin::format_ok<"%*.*f %lf", int, int, double, float>);
+static_assert(lin::format_ok<"%s", char[4]>);
+static_assert(lin::format_ok<"%.*q %#q", int, const char *, char *>);
+static_assert(!lin::format_ok<"%lq", const char *>);
+static_assert(lin::format_ok<"% .*H %.4H", int, const unsigned char *, int *>);
+static_assert(!lin::format_ok<"%.*H", int, int>);
+static_assert(!lin::format_ok<"%H", const unsigned char *>);
+static_assert(!lin::format_ok<"%8H", const unsigned char *>);
+static_assert(lin::format_ok<"%I64D", int, std::int64_t>);
+static_assert(!lin::format_ok<"%I64D", std::int64_t>);
+static_assert(!lin::format_ok<"%D", long, int>);
+static_assert(!lin::format_ok<"%d", unsigned>);
+static_assert(!lin::format_ok<"%d", long long>);
+static_assert(!lin::format_ok<"%d", bool>);
+static_assert(!lin::format_ok<"%d", double>);
+static_assert(!lin::format_ok<"%u", int>);
+static_assert(!lin::format_ok<"%hhu", unsigned>);
+static_assert(!lin::format_ok<"%I32d", std::int64_t>);
+static_assert(!lin::format_ok<"%f", int>);
+static_assert(!lin::format_ok<"%Lf", double>);
+static_assert(!lin::format_ok<"%s", int *>);
+static_assert(!lin::format_ok<"%ls", const char *>);
+static_assert(!lin::format_ok<"%p", int>);
+static_assert(!lin::format_ok<"%*d", long, int>);
+static_assert(!lin::format_ok<"%d">);
+static_assert(!lin::format_ok<"%d", int, int>);
+static_assert(!lin::format_ok<"%y", int>);
+static_assert(!lin::format_ok<"%", int>);
+static_assert(!lin::format_ok<"%r", const char *, lin_va_list>);
+
+int main()
+{
+    char buffer[200];
+    int res;
+
+    res = lin::format_to<"hello">(buffer, sizeof(buffer));
+    assert(res == 5);
+    REQUIRE_STR_EQ(buffer, "hello");
+
+    res = lin::format_to<"%s=%d%%">(buffer, sizeof(buffer), "x", -42);
+    assert(res == 6);
+    REQUIRE_STR_EQ(buffer, "x=-42%");
+
+    res = lin::format_to<"[%-6s|%6.2s|%c]">(buffer, sizeof(buffer), "ab",
+                                            "xyz", 'q');
+    REQUIRE_STR_EQ(buffer, "[ab    |    xy|q]");
+
+    lin::format_to<"%hhd %hd %ld %lld %jd %zd">(buffer, sizeof(buffer),
+        static_cast<signed char>(-128), static_cast<short>(-32768), -1L,
+        static_cast<long long>(INT64_MIN), INTMAX_MIN, static_cast<ptrdiff_t>(7));
+    REQUIRE_STR_EQ(buffer, "-128 -32768 -1 -9223372036854775808 "
+                           "-9223372036854775808 7");
+
+    lin::format_to<"%I64u %#I64x %I32d %I8u %#o %b">(buffer, sizeof(buffer),
+        UINT64_MAX, UINT64_C(0xdeadbeef12345678), INT32_MIN,
+        static_cast<std::uint8_t>(255), 8u, 5u);
+    REQUIRE_STR_EQ(buffer, "18446744073709551615 0xdeadbeef12345678 "
+                           "-2147483648 255 010 101");
+
+    // Narrower types are converted like with promotion in C.
+    lin::format_to<"%d %u %I64d %c">(buffer, sizeof(buffer),
+        static_cast<unsigned char>(200), static_cast<unsigned short>(65535),
+        -5, static_cast<unsigned char>('A'));
+    REQUIRE_STR_EQ(buffer, "200 65535 -5 A");
+
+    lin::format_to<"%*d|%-*d|%.*f|%*s">(buffer, sizeof(buffer), 5, 42, -4, 7,
+                                        3, 3.14159, -3, "a");
+    REQUIRE_STR_EQ(buffer, "   42|7   |3.142|a  ");
+
+    lin::format_to<"%e %g %a %v %f">(buffer, sizeof(buffer), 1e100, 0.0001,
+                                     1.0, 0.1f, 2.5);
+    REQUIRE_STR_EQ(buffer, "1.000000e+100 0.0001 0x1p+0 0.10000000149011612 "
+                           "2.500000");
+
+    lin::format_to<"%.1I64D|%D">(buffer, sizeof(buffer), 2,
+                                  static_cast<std::int64_t>(-12355), 0, 7);
+    REQUIRE_STR_EQ(buffer, "-123.6|7");
+
+    const unsigned char bytes[] = {0xde, 0xad, 0xbe, 0xef, 0x01};
+    lin::format_to<"%.*H|%# .2H">(buffer, sizeof(buffer), 5, bytes, bytes);
+    REQUIRE_STR_EQ(buffer, "deadbeef01|DE AD");
+
+    lin::format_to<"%p %p">(buffer, sizeof(buffer),
+                            reinterpret_cast<const void *>(0x1234), nullptr);
+    char expect[200];
+    std::snprintf(expect, sizeof(expect), "%p", reinterpret_cast<void *>(0x1234));
+    assert(!std::strncmp(buffer, expect, std::strlen(expect)));
+
+    // Truncation and length, as lin_snprintf().
+    res = lin::format_to<"%d-%s">(buffer, 4, 12345, "abc");
+    assert(res == 9);
+    REQUIRE_STR_EQ(buffer, "123");
+    res = lin::format_to<"%d-%s">(nullptr, 0, 12345, "abc");
+    assert(res == 9);
+
+    std::printf("All C++ tests succeeded.\n");
+    return 0;
+}
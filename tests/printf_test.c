@@ -31,12 +31,14 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <stddef.h>
 #include <math.h>
 #include <limits.h>
+#include <float.h>
 
 #include "printf.h"
 
@@ -428,6 +430,10 @@ static void run_test(snprintf_type cur_snprintf)
     TEST_SNPRINTF(("%lu", 0xFFFFFFFFL), "4294967295");
     TEST_SNPRINTF(("%llu", 281474976710656LLU), "281474976710656");
     TEST_SNPRINTF(("%llu", 18446744073709551615LLU), "18446744073709551615");
+    TEST_SNPRINTF(("%llu", 99999999LLU), "99999999");
+    TEST_SNPRINTF(("%llu", 100000000LLU), "100000000");
+    TEST_SNPRINTF(("%llu", 4294967296LLU), "4294967296");
+    TEST_SNPRINTF(("%lld", -1000000000000000001LL), "-1000000000000000001");
     TEST_SNPRINTF(("%zu", (size_t)2147483647UL), "2147483647");
     TEST_SNPRINTF(("%zd", (ptrdiff_t)2147483647UL), "2147483647");
     TEST_SNPRINTF(("%tu", (size_t)2147483647UL), "2147483647");
@@ -443,6 +449,9 @@ static void run_test(snprintf_type cur_snprintf)
     TEST_SNPRINTF(("%lo", 12345678L), "57060516");
     TEST_SNPRINTF(("%lx", 0x12345678L), "12345678");
     TEST_SNPRINTF(("%llx", 0x1234567891234567LLU), "1234567891234567");
+    TEST_SNPRINTF(("%#llx", 0x1234567891234567LLU), "0x1234567891234567");
+    TEST_SNPRINTF(("%#llo", 01234567012345670123LLU), "01234567012345670123");
+    TEST_SNPRINTF(("%.0llu", 10000000000LLU), "10000000000");
     TEST_SNPRINTF(("%lx", 0xabcdefabL), "abcdefab");
     TEST_SNPRINTF(("%lX", 0xabcdefabL), "ABCDEFAB");
     TEST_SNPRINTF(("%c", 'v'), "v");
@@ -645,6 +654,35 @@ static void run_test(snprintf_type cur_snprintf)
     TEST_SNPRINTF(("%.2e", 1505000.00000095367431640625), "1.51e+06");
     TEST_SNPRINTF(("%.2e", 1505001.0), "1.51e+06");
     TEST_SNPRINTF(("%.2e", 1506000.0), "1.51e+06");
+    TEST_SNPRINTF(("%.30f", 0.1), "0.100000000000000005551115123126");
+    TEST_SNPRINTF(("%.20e", 4.9406564584124654e-324),
+                  "4.94065645841246544177e-324");
+    TEST_SNPRINTF(("%.20e", 2.2250738585072009e-308),
+                  "2.22507385850720088902e-308");
+    TEST_SNPRINTF(("%.1f", 0x1p100), "1267650600228229401496703205376.0");
+    TEST_SNPRINTF(("%.3e", DBL_MAX), "1.798e+308");
+    TEST_SNPRINTF(("%.5e", 0x1p1000), "1.07151e+301");
+    TEST_SNPRINTF(("%.40e", 0x1p-1074),
+                  "4.9406564584124654417656879286822137236506e-324");
+    TEST_SNPRINTF(("%.25g", 0x1.fffffffffffffp-1000),
+                  "1.866527237006437550754028e-301");
+
+    /* exact ties round to even, carries into the next digit */
+    TEST_SNPRINTF(("%.0f", 0.5), "0");
+    TEST_SNPRINTF(("%.0f", 2.5), "2");
+    TEST_SNPRINTF(("%.0f", 3.5), "4");
+    TEST_SNPRINTF(("%.2f", 0.125), "0.12");
+    TEST_SNPRINTF(("%.2f", 0.375), "0.38");
+    TEST_SNPRINTF(("%.1e", 0.25), "2.5e-01");
+    TEST_SNPRINTF(("%.0e", 0.25), "2e-01");
+    TEST_SNPRINTF(("%.6e", 9.9999996), "1.000000e+01");
+    TEST_SNPRINTF(("%.2f", 9.999), "10.00");
+    TEST_SNPRINTF(("%g", 999999.5), "1e+06");
+    TEST_SNPRINTF(("%g", 0.00009999995), "0.0001");
+    TEST_SNPRINTF(("%.17e", 0.1), "1.00000000000000006e-01");
+    TEST_SNPRINTF(("%.17f", 1e-20), "0.00000000000000000");
+    TEST_SNPRINTF(("%.3f", 1e19), "10000000000000000000.000");
+    TEST_SNPRINTF(("%.3e", 1e-310), "1.000e-310");
 
     /* correctness in DBL_DIG places */
     TEST_SNPRINTF(("%.15g", 1.23456789012345), "1.23456789012345");
@@ -672,6 +710,12 @@ static void run_test(snprintf_type cur_snprintf)
     TEST_SNPRINTF_N(("%d", 123456), 6);
     TEST_SNPRINTF_N(("%.4s", "hello"), 4);
     TEST_SNPRINTF_N(("%.0s", "goodbye"), 0);
+    {
+        // (not 0-terminated)
+        const char abc[3] = {'a', 'b', 'c'};
+        TEST_SNPRINTF(("%.3s", abc), "abc");
+        TEST_SNPRINTF(("%.2s", abc), "ab");
+    }
 
     {
         char b[] = "xxxxxxxx";
@@ -710,6 +754,13 @@ static void run_test(snprintf_type cur_snprintf)
     #endif
 
     TEST_SNPRINTF_N(("%.4a", 1.0), 11);
+    TEST_SNPRINTF(("%.12a", 0x1.8bb523425de4cp-325), "0x1.8bb523425de5p-325");
+    TEST_SNPRINTF(("%.13a", 0x1.8bb523425de4cp-325), "0x1.8bb523425de4cp-325");
+    TEST_SNPRINTF(("%.1a", 0x1.f8p+0), "0x2.0p+0");
+    TEST_SNPRINTF(("%.1a", 0x1.08p+0), "0x1.0p+0");
+    TEST_SNPRINTF(("%.1a", 0x1.18p+0), "0x1.2p+0");
+    TEST_SNPRINTF(("%.1a", -0x1.18p+0), "-0x1.2p+0");
+    TEST_SNPRINTF(("%.2A", 0x1.0081p+0), "0X1.01P+0");
 
     #if TEST_IMPL_DEFINED
     int r = cur_snprintf(buffer, sizeof(buffer), "a%wb", &(int){0});
@@ -726,6 +777,629 @@ static void run_test(snprintf_type cur_snprintf)
     printf("All tests succeeded.\n");
 }
 
+struct cb_test {
+    char buf[8000];
+    size_t len;
+    int calls;
+};
+
+static void cb_test_append(void *ctx, const char *data, size_t len)
+{
+    struct cb_test *t = ctx;
+    REQUIRE(len > 0);
+    REQUIRE(t->len + len < sizeof(t->buf));
+    memcpy(t->buf + t->len, data, len);
+    t->len += len;
+    t->buf[t->len] = '\0';
+    t->calls++;
+}
+
+struct alloc_test {
+    int calls;
+    int fail_after;
+};
+
+// Records the conversions reported by lin_vsnprintf_ex().
+struct hook_test {
+    struct lin_conv_info infos[16];
+    int num;
+};
+
+static void hook_test_conv(void *ctx, const struct lin_conv_info *info)
+{
+    struct hook_test *t = ctx;
+    assert(t->num < 16);
+    t->infos[t->num++] = *info;
+}
+
+static int hook_test_snprintf(struct hook_test *t, char *buf, size_t size,
+                              const char *format, ...)
+{
+    struct lin_printf_hooks hooks = {hook_test_conv, t};
+    va_list ap;
+    va_start(ap, format);
+    t->num = 0;
+    int r = lin_vsnprintf_ex(buf, size, &hooks, format, ap);
+    va_end(ap);
+    return r;
+}
+
+// Executor for lin_format_array_par(); runs the tasks in reverse order.
+static void exec_reverse(void *ctx, void (*task)(void *task_ctx, size_t i),
+                         void *task_ctx, size_t num_tasks)
+{
+    (void)ctx;
+    while (num_tasks--)
+        task(task_ctx, num_tasks);
+}
+
+static void *alloc_test_realloc(void *ctx, void *ptr, size_t size)
+{
+    struct alloc_test *t = ctx;
+    if (!size) {
+        free(ptr);
+        return NULL;
+    }
+    if (t->calls++ >= t->fail_after)
+        return NULL;
+    return realloc(ptr, size);
+}
+
+// Tests for libinsanity-only extensions (which gcc's format checker does not
+// know about).
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat"
+#pragma GCC diagnostic ignored "-Wformat-extra-args"
+static void run_lin_test(void)
+{
+    snprintf_type cur_snprintf = lin_snprintf;
+    char buffer[200];
+
+    // shortest round-trip
+    TEST_SNPRINTF(("%v", 0.0), "0");
+    TEST_SNPRINTF(("%v", -0.0), "-0");
+    TEST_SNPRINTF(("%v", 1.0), "1");
+    TEST_SNPRINTF(("%v", 0.1), "0.1");
+    TEST_SNPRINTF(("%v", 1.1), "1.1");
+    TEST_SNPRINTF(("%v", 0.3), "0.3");
+    TEST_SNPRINTF(("%v", 0.1 + 0.2), "0.30000000000000004");
+    TEST_SNPRINTF(("%v", 123456.0), "123456");
+    TEST_SNPRINTF(("%v", 0.0001), "0.0001");
+    TEST_SNPRINTF(("%v", 0.00001), "1e-05");
+    TEST_SNPRINTF(("%v", 1e16), "10000000000000000");
+    TEST_SNPRINTF(("%v", 1e17), "1e+17");
+    TEST_SNPRINTF(("%v", 1.5e300), "1.5e+300");
+    TEST_SNPRINTF(("%V", 1.5e300), "1.5E+300");
+    TEST_SNPRINTF(("%v", M_PI), "3.141592653589793");
+    TEST_SNPRINTF(("%v", DBL_MAX), "1.7976931348623157e+308");
+    TEST_SNPRINTF(("%v", DBL_MIN), "2.2250738585072014e-308");
+    TEST_SNPRINTF(("%v", 0x1p-1074), "5e-324");
+    TEST_SNPRINTF(("%v", 9007199254740993.0), "9007199254740992");
+    TEST_SNPRINTF(("%v", 2.0 / 3), "0.6666666666666666");
+    TEST_SNPRINTF(("%v", INFINITY), "inf");
+    TEST_SNPRINTF(("%V", -INFINITY), "-INF");
+    TEST_SNPRINTF(("%v", NAN), "nan");
+    TEST_SNPRINTF(("%+v", 2.5), "+2.5");
+    TEST_SNPRINTF(("% v", 2.5), " 2.5");
+    TEST_SNPRINTF(("%#v", 2.0), "2.");
+    TEST_SNPRINTF(("%8v|", -2.5), "    -2.5|");
+    TEST_SNPRINTF(("%-8v|", 2.5), "2.5     |");
+    TEST_SNPRINTF(("%08v", -2.5), "-00002.5");
+    TEST_SNPRINTF(("%.2v", 2.125), "2.125");
+
+    // fixed-point
+    TEST_SNPRINTF(("%D", 2, 12345), "123.45");
+    TEST_SNPRINTF(("%D", 2, -5), "-0.05");
+    TEST_SNPRINTF(("%D", 0, 42), "42");
+    TEST_SNPRINTF(("%#D", 0, 42), "42.");
+    TEST_SNPRINTF(("%.4D", 2, 12345), "123.4500");
+    TEST_SNPRINTF(("%.1D", 2, 12345), "123.4");
+    TEST_SNPRINTF(("%.1D", 2, 12355), "123.6");
+    TEST_SNPRINTF(("%.1D", 2, 12351), "123.5");
+    TEST_SNPRINTF(("%.0D", 2, 150), "2");
+    TEST_SNPRINTF(("%.0D", 2, 250), "2");
+    TEST_SNPRINTF(("%.0D", 2, -251), "-3");
+    TEST_SNPRINTF(("%.0D", 3, -1), "-0");
+    TEST_SNPRINTF(("%.1D", 2, 9999), "100.0");
+    TEST_SNPRINTF(("%+10.3D|%-9D|% D", 3, 7, 1, -7, 1, 7), "    +0.007|-0.7     | 0.7");
+    TEST_SNPRINTF(("%010D|%-010D", 2, -314, 2, 314), "-000003.14|3.14      ");
+    TEST_SNPRINTF(("%*.*D", 8, 1, 4, 12345), "     1.2");
+    TEST_SNPRINTF(("%I64D", 6, INT64_MIN), "-9223372036854.775808");
+    TEST_SNPRINTF(("%llD", 19, LLONG_MAX), "0.9223372036854775807");
+    TEST_SNPRINTF(("%.2hhD", 1, -128), "-12.80");
+    TEST_SNPRINTF(("%.0I64D", 19, INT64_C(5000000000000000000)), "0");
+    TEST_SNPRINTF(("%.0I64D", 19, INT64_C(5000000000000000001)), "1");
+    TEST_SNPRINTF(("%.25D", 1, 1), "0.1000000000000000000000000");
+    TEST_SNPRINTF(("%D", 20, 1), "<error>");
+    TEST_SNPRINTF(("%D", -1, 1), "<error>");
+    TEST_SNPRINTF_N(("%12.3D", 2, 1), 12);
+
+    // 128 bit integers
+    #ifdef __SIZEOF_INT128__
+    {
+        __int128 max = (__int128)(~(unsigned __int128)0 >> 1);
+        unsigned __int128 e19 = UINT64_C(10000000000000000000);
+        TEST_SNPRINTF(("%I128d", max), "170141183460469231731687303715884105727");
+        TEST_SNPRINTF(("%I128d", -max - 1),
+                      "-170141183460469231731687303715884105728");
+        TEST_SNPRINTF(("%I128u", ~(unsigned __int128)0),
+                      "340282366920938463463374607431768211455");
+        TEST_SNPRINTF(("%I128u", e19 * e19), "100000000000000000000000000000000000000");
+        TEST_SNPRINTF(("%I128u", e19 * e19 - 1), "99999999999999999999999999999999999999");
+        TEST_SNPRINTF(("%I128u", e19 * 5 + 7), "50000000000000000007");
+        TEST_SNPRINTF(("%I128u", e19 * 2), "20000000000000000000");
+        TEST_SNPRINTF(("%I128d", (__int128)-42), "-42");
+        TEST_SNPRINTF(("%.0I128d", (__int128)0), "");
+        TEST_SNPRINTF(("%+I128d|% I128d", (__int128)e19 * e19, (__int128)1),
+                      "+100000000000000000000000000000000000000| 1");
+        TEST_SNPRINTF(("%042I128d", -(__int128)e19 * 3),
+                      "-00000000000000000000030000000000000000000");
+        TEST_SNPRINTF(("%24.22I128u", e19 * 2), "  0020000000000000000000");
+        TEST_SNPRINTF(("%#I128x", ((unsigned __int128)0x123456789abcdef << 64) | 0xf0),
+                      "0x123456789abcdef00000000000000f0");
+        TEST_SNPRINTF(("%#40I128X", ~(unsigned __int128)0),
+                      "      0XFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF");
+        TEST_SNPRINTF(("%#I128o", (unsigned __int128)1 << 127),
+                      "02000000000000000000000000000000000000000000");
+        TEST_SNPRINTF(("%#I128b", ((unsigned __int128)1 << 100) | 5),
+                      "0b10000000000000000000000000000000000000000000000000"
+                      "000000000000000000000000000000000000000000000000101");
+        TEST_SNPRINTF(("%I128x %d", (unsigned __int128)0xab, 7), "ab 7");
+        TEST_SNPRINTF_N(("%I128D", 2, (__int128)1), -1);
+    }
+    #endif
+
+    // quoted strings
+    TEST_SNPRINTF(("%q", "abc"), "\"abc\"");
+    TEST_SNPRINTF(("%q", ""), "\"\"");
+    TEST_SNPRINTF(("%q", "a\"b\\c\n\t\r\b\f\a\v\x01\x1f\x7f\xc3\xa4"),
+                  "\"a\\\"b\\\\c\\n\\t\\r\\b\\f\\a\\v\\001\\037\\177\xc3\xa4\"");
+    TEST_SNPRINTF(("%#q", "a\"b\\c\n\t\r\b\f\a\v\x01\x1f\x7f\xc3\xa4"),
+                  "\"a\\\"b\\\\c\\n\\t\\r\\b\\f\\u0007\\u000b\\u0001\\u001f\x7f\xc3\xa4\"");
+    TEST_SNPRINTF(("%q", "0123456789abcdef\n0123456789abcdef\"x"),
+                  "\"0123456789abcdef\\n0123456789abcdef\\\"x\"");
+    TEST_SNPRINTF(("%q", "\x01" "1"), "\"\\0011\"");
+    TEST_SNPRINTF(("%.5q", "abc\ndef"), "\"abc\\nd\"");
+    TEST_SNPRINTF(("%.3q", (char[3]){'a', '\n', 'b'}), "\"a\\nb\"");
+    TEST_SNPRINTF(("%8q|%-8q|%3q", "a\n", "a\n", "abc"), "   \"a\\n\"|\"a\\n\"   |\"abc\"");
+    TEST_SNPRINTF_N(("%q", "a\tb"), 6);
+    TEST_SNPRINTF_N(("%#q", "\x02"), 8);
+
+    // hex dumps
+    {
+        static const unsigned char bytes[] = {
+            0x00, 0x01, 0x7f, 0x80, 0x9a, 0xab, 0xcd, 0xef, 0xff, 0x10,
+        };
+        TEST_SNPRINTF(("%.*H", 10, bytes), "00017f809aabcdefff10");
+        TEST_SNPRINTF(("%#.*H", 10, bytes), "00017F809AABCDEFFF10");
+        TEST_SNPRINTF(("% .*H", 10, bytes), "00 01 7f 80 9a ab cd ef ff 10");
+        TEST_SNPRINTF(("%# .3H|", bytes + 7), "EF FF 10|");
+        TEST_SNPRINTF(("%.0H|% .0H|%.1H", bytes, bytes, bytes + 8), "||ff");
+        TEST_SNPRINTF(("%8.2H|%-8.2H|%3.2H", bytes + 4, bytes + 4, bytes + 4),
+                      "    9aab|9aab    |9aab");
+        TEST_SNPRINTF(("%H", bytes), "<error>");
+        TEST_SNPRINTF_N(("% .*H", 10, bytes), 29);
+        TEST_SNPRINTF_N(("%40.*H", 10, bytes), 40);
+
+        // large dumps, written in chunks or truncated
+        unsigned char big[1000];
+        char expect[3000], *e = expect;
+        for (size_t n = 0; n < sizeof(big); n++) {
+            big[n] = (unsigned char)(n * 37 + 5);
+            e += sprintf(e, n ? " %02x" : "%02x", big[n]);
+        }
+        char out[3000];
+        REQUIRE_INT_EQ(lin_snprintf(out, sizeof(out), "% .*H", 1000, big), 2999);
+        REQUIRE_STR_EQ(out, expect);
+        REQUIRE_INT_EQ(lin_snprintf(out, 100, "% .*H", 1000, big), 2999);
+        REQUIRE(!strncmp(out, expect, 99) && !out[99]);
+        REQUIRE_INT_EQ(lin_snprintf_trunc(out, 100, "% .*H", 1000, big), 100);
+        REQUIRE(!strncmp(out, expect, 99));
+        static struct cb_test t;
+        int r = lin_cbprintf(cb_test_append, &t, "% .*H", 1000, big);
+        REQUIRE_INT_EQ(r, 2999);
+        REQUIRE(t.len == 2999 && !memcmp(t.buf, expect, 2999));
+    }
+
+    // %a normalizes subnormals (the leading digit is always 1, except 0 and
+    // when rounding carries)
+    TEST_SNPRINTF(("%a", 0x1p-1074), "0x1p-1074");
+    TEST_SNPRINTF(("%a", 0x1.8p-1070), "0x1.8p-1070");
+    TEST_SNPRINTF(("%.0a", 0x1.8p-1073), "0x2p-1073");
+    TEST_SNPRINTF(("%a", 0x1.ffffffffffffep-1023), "0x1.ffffffffffffep-1023");
+    TEST_SNPRINTF(("%#a", 0.0), "0x0.p+0");
+    TEST_SNPRINTF(("%.3a", -0.0), "-0x0.000p+0");
+
+    // compiled format strings
+    struct lin_format_spec specs[8];
+    REQUIRE_INT_EQ(lin_format_compile(NULL, 0, "x%dy%sz"), 3);
+    REQUIRE_INT_EQ(lin_format_compile(specs, 8, "%"), -1);
+    REQUIRE_INT_EQ(lin_format_compile(specs, 8, "a%wb"), -1);
+    REQUIRE_INT_EQ(lin_format_compile(specs, 8, "a%d|%-*s|%.3f%%z"), 5);
+    int res = lin_snprintf_compiled(buffer, sizeof(buffer), specs, 42, 5, "ab",
+                                    1.5);
+    REQUIRE_STR_EQ(buffer, "a42|ab   |1.500%z");
+    REQUIRE_INT_EQ(res, 17);
+    res = lin_snprintf_compiled(buffer, 5, specs, -42, -3, "abcd", 1.5);
+    REQUIRE_STR_EQ(buffer, "a-42");
+    REQUIRE_INT_EQ(res, 17);
+    REQUIRE_INT_EQ(lin_format_compile(specs, 8, ""), 1);
+    REQUIRE_INT_EQ(lin_snprintf_compiled(buffer, sizeof(buffer), specs), 0);
+    REQUIRE_STR_EQ(buffer, "");
+
+    // measuring output length
+    REQUIRE_INT_EQ(lin_format_len("%d|%5s|%-#8x", 12345, "ab", 255u), 20);
+    REQUIRE_INT_EQ(lin_format_len("%.30f", 1e22), 54);
+    REQUIRE_INT_EQ(lin_format_len("%.20e", 1e-300), 27);
+    REQUIRE_INT_EQ(lin_format_len("%w"), -1);
+    {
+        static const char *const formats[] = {
+            "%.20f", "%.40e", "%#.25g", "%.25g", "%40.18E", "%-+#30.19f",
+        };
+        static const double values[] = {
+            0, 0.5, 1, 9.999999999999999e22, 1e23, 1e22, 0x1p-1074, 1e-5,
+            0.99999999999999999, 99999.999999999999, -1e300, 123.456,
+        };
+        for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+            for (size_t v = 0; v < sizeof(values) / sizeof(values[0]); v++) {
+                int r = lin_snprintf(buffer, sizeof(buffer), formats[f],
+                                     values[v]);
+                REQUIRE_INT_EQ(lin_format_len(formats[f], values[v]), r);
+            }
+        }
+    }
+
+    // stopping at truncation
+    REQUIRE_INT_EQ(lin_snprintf_trunc(buffer, 10, "%d-%s", 123, "ab"), 6);
+    REQUIRE_STR_EQ(buffer, "123-ab");
+    REQUIRE_INT_EQ(lin_snprintf_trunc(buffer, 7, "%d-%s", 123, "ab"), 6);
+    REQUIRE_STR_EQ(buffer, "123-ab");
+    REQUIRE_INT_EQ(lin_snprintf_trunc(buffer, 6, "%d-%s", 123, "ab"), 6);
+    REQUIRE_STR_EQ(buffer, "123-a");
+    REQUIRE_INT_EQ(lin_snprintf_trunc(buffer, 4, "abc%s", ""), 3);
+    REQUIRE_STR_EQ(buffer, "abc");
+    REQUIRE_INT_EQ(lin_snprintf_trunc(buffer, 4, "abc%sX", ""), 4);
+    REQUIRE_STR_EQ(buffer, "abc");
+    REQUIRE_INT_EQ(lin_snprintf_trunc(buffer, 8, "%20s", "abc"), 8);
+    REQUIRE_STR_EQ(buffer, "       ");
+    REQUIRE_INT_EQ(lin_snprintf_trunc(buffer, 8, "%-6s|%s", "abc", "x"), 8);
+    REQUIRE_STR_EQ(buffer, "abc   |");
+    REQUIRE_INT_EQ(lin_snprintf_trunc(buffer, 4, "%5s", "abcdefghij"), 4);
+    REQUIRE_STR_EQ(buffer, "abc");
+    REQUIRE_INT_EQ(lin_snprintf_trunc(buffer, 6, "%q", "hello world"), 6);
+    REQUIRE_STR_EQ(buffer, "\"hell");
+    {
+        // (The volatile keeps gcc from warning about the huge widths.)
+        volatile int huge = INT_MAX;
+        int r = lin_snprintf_trunc(buffer, 5, "%*d%*d", huge, 1, huge, 2);
+        REQUIRE_INT_EQ(r, 5);
+        REQUIRE_STR_EQ(buffer, "    ");
+    }
+    REQUIRE_INT_EQ(lin_snprintf_trunc(buffer, 1, "%.300f", 1e-300), 1);
+    REQUIRE_STR_EQ(buffer, "");
+    // a float conversion that reaches the end of the buffer only counts the
+    // rest of its digits
+    REQUIRE_INT_EQ(lin_snprintf_trunc(buffer, 16, "%.300f|%d", 1.2345e-300, 1),
+                   16);
+    REQUIRE_STR_EQ(buffer, "0.0000000000000");
+    REQUIRE_INT_EQ(lin_snprintf(buffer, 16, "%.300f|%d", 1.2345e-300, 1), 304);
+    REQUIRE_STR_EQ(buffer, "0.0000000000000");
+    REQUIRE_INT_EQ(lin_snprintf(buffer, 16, "%.300f", 1e300), 602);
+    REQUIRE_STR_EQ(buffer, "100000000000000");
+    REQUIRE_INT_EQ(lin_snprintf(buffer, 16, "%-310.300e|", 1.2345e-300), 311);
+    REQUIRE_STR_EQ(buffer, "1.2344999999999");
+    REQUIRE_INT_EQ(lin_snprintf_trunc(NULL, 0, "%d", 12345), 5);
+    REQUIRE_INT_EQ(lin_snprintf_trunc(buffer, 4, "abcdef%w"), -1);
+
+    // array formatting
+    {
+        static const int32_t i32[] = {1, -2, 300, INT32_MIN};
+        static const double dbl[] = {0.5, -1.25, 1e100};
+        static const struct { int64_t a; uint64_t b; } pairs[] = {
+            {1, UINT64_MAX}, {INT64_MIN, 2},
+        };
+        ptrdiff_t n;
+        n = lin_format_array(buffer, sizeof(buffer), "%d", ", ",
+                             LIN_ELEM_INT32, i32, 4, sizeof(i32[0]));
+        REQUIRE_INT_EQ((int)n, 4);
+        REQUIRE_STR_EQ(buffer, "1, -2, 300, -2147483648");
+        n = lin_format_array(buffer, sizeof(buffer), "<%04x>", "",
+                             LIN_ELEM_INT32, i32, 2, sizeof(i32[0]));
+        REQUIRE_INT_EQ((int)n, 2);
+        REQUIRE_STR_EQ(buffer, "<0001><fffffffe>");
+        n = lin_format_array(buffer, sizeof(buffer), "%.3g", ";",
+                             LIN_ELEM_DOUBLE, dbl, 3, sizeof(dbl[0]));
+        REQUIRE_INT_EQ((int)n, 3);
+        REQUIRE_STR_EQ(buffer, "0.5;-1.25;1e+100");
+        n = lin_format_array(buffer, sizeof(buffer), "%d", " ",
+                             LIN_ELEM_INT64, &pairs[0].a, 2, sizeof(pairs[0]));
+        REQUIRE_INT_EQ((int)n, 2);
+        REQUIRE_STR_EQ(buffer, "1 -9223372036854775808");
+        n = lin_format_array(buffer, sizeof(buffer), "%i", " ",
+                             LIN_ELEM_UINT64, &pairs[0].b, 2, sizeof(pairs[0]));
+        REQUIRE_INT_EQ((int)n, 2);
+        REQUIRE_STR_EQ(buffer, "18446744073709551615 2");
+        n = lin_format_array(buffer, sizeof(buffer), "[%d]", ",",
+                             LIN_ELEM_INT32, i32, 4, sizeof(i32[0]));
+        REQUIRE_INT_EQ((int)n, 4);
+        REQUIRE_STR_EQ(buffer, "[1],[-2],[300],[-2147483648]");
+        n = lin_format_array(buffer, sizeof(buffer), "[%d]", ", ",
+                             LIN_ELEM_INT32, i32, 4, sizeof(i32[0]));
+        REQUIRE_INT_EQ((int)n, 4);
+        REQUIRE_STR_EQ(buffer, "[1], [-2], [300], [-2147483648]");
+        // resuming when the buffer is full
+        n = lin_format_array(buffer, 13, "%d", ", ",
+                             LIN_ELEM_INT32, i32, 4, sizeof(i32[0]));
+        REQUIRE_INT_EQ((int)n, 3);
+        REQUIRE_STR_EQ(buffer, "1, -2, 300, ");
+        n = lin_format_array(buffer, 13, "%d", ", ",
+                             LIN_ELEM_INT32, i32 + 3, 1, sizeof(i32[0]));
+        REQUIRE_INT_EQ((int)n, 1);
+        REQUIRE_STR_EQ(buffer, "-2147483648");
+        n = lin_format_array(buffer, 5, "%d", ", ",
+                             LIN_ELEM_INT32, i32 + 3, 1, sizeof(i32[0]));
+        REQUIRE_INT_EQ((int)n, 0);
+        REQUIRE_STR_EQ(buffer, "");
+        // resuming with the direct write path
+        {
+            int64_t vals[200];
+            char all[200 * 22] = "", chunk[50];
+            size_t all_len = 0;
+            for (int i = 0; i < 200; i++) {
+                vals[i] = (i & 1 ? -1 : 1) * (INT64_C(1) << (i % 64)) / 3;
+                all_len += lin_snprintf(all + all_len, sizeof(all) - all_len,
+                                        i < 199 ? "%"PRId64"|" : "%"PRId64,
+                                        vals[i]);
+            }
+            size_t done = 0, pos = 0;
+            while (done < 200) {
+                n = lin_format_array(chunk, sizeof(chunk), "%i", "|",
+                                     LIN_ELEM_INT64, vals + done, 200 - done,
+                                     sizeof(vals[0]));
+                REQUIRE(n > 0);
+                REQUIRE(!strncmp(all + pos, chunk, strlen(chunk)));
+                pos += strlen(chunk);
+                done += n;
+            }
+            REQUIRE(pos == all_len);
+        }
+        // parallel formatting gives the same result for any size
+        {
+            static const char *specs[] = {"%d", "(%x)", "%.2f"};
+            double dvals[20];
+            int32_t ivals[20];
+            size_t lens[20 / 7 + 2];
+            char expect[200];
+            for (int i = 0; i < 20; i++) {
+                ivals[i] = (i & 1 ? -1 : 1) * (INT32_C(1) << (i % 12)) / 3;
+                dvals[i] = ivals[i] / 7.0;
+            }
+            for (int s = 0; s < 3; s++) {
+                enum lin_elem_type t = s == 2 ? LIN_ELEM_DOUBLE : LIN_ELEM_INT32;
+                const void *vals = s == 2 ? (void *)dvals : (void *)ivals;
+                size_t stride = s == 2 ? sizeof(double) : sizeof(int32_t);
+                for (size_t size = 0; size <= sizeof(expect); size++) {
+                    ptrdiff_t n1 = lin_format_array(expect, size, specs[s], ", ",
+                                                    t, vals, 20, stride);
+                    ptrdiff_t n2 = lin_format_array_par(buffer, size, specs[s],
+                                                        ", ", t, vals, 20,
+                                                        stride, 7, lens,
+                                                        exec_reverse, NULL);
+                    REQUIRE(n1 == n2);
+                    if (size)
+                        REQUIRE_STR_EQ(buffer, expect);
+                }
+            }
+            n = lin_format_array_par(buffer, sizeof(buffer), "%d", "",
+                                     LIN_ELEM_INT32, i32, 1, 4, 0, lens,
+                                     exec_reverse, NULL);
+            REQUIRE_INT_EQ((int)n, -1);
+        }
+        // invalid specs
+        REQUIRE_INT_EQ((int)lin_format_array(buffer, sizeof(buffer), "%f", "",
+                       LIN_ELEM_INT32, i32, 1, 4), -1);
+        REQUIRE_INT_EQ((int)lin_format_array(buffer, sizeof(buffer), "%d%d",
+                       "", LIN_ELEM_INT32, i32, 1, 4), -1);
+        REQUIRE_INT_EQ((int)lin_format_array(buffer, sizeof(buffer), "%ld", "",
+                       LIN_ELEM_INT32, i32, 1, 4), -1);
+        REQUIRE_INT_EQ((int)lin_format_array(buffer, sizeof(buffer), "%*d", "",
+                       LIN_ELEM_INT32, i32, 1, 4), -1);
+    }
+
+    // instrumentation hooks
+    {
+        struct hook_test t;
+        int r = hook_test_snprintf(&t, buffer, sizeof(buffer),
+                                   "%5d|%-3s|%.1f|%.30f|%.20e|%a|%v|%%|%05d|%f",
+                                   42, "ab", 1.25, 0.1, 1e300, 1.0, 0.5, -7,
+                                   INFINITY);
+        REQUIRE_STR_EQ(buffer, "   42|ab |1.2|0.100000000000000005551115123126|"
+                       "1.00000000000000005250e+300|0x1p+0|0.5|%|-0007|inf");
+        REQUIRE_INT_EQ(r, (int)strlen(buffer));
+#if LIN_PRINTF_HOOKS
+        static const struct { char conv; int bytes, pad, fp; } expect[] = {
+            {'d', 5, 3, LIN_FP_NONE},
+            {'s', 3, 1, LIN_FP_NONE},
+            {'f', 3, 0, LIN_FP_FIXED},
+            {'f', 32, 0, LIN_FP_BIGNUM},
+            {'e', 27, 0, LIN_FP_BIGNUM},
+            {'a', 6, 0, LIN_FP_HEX},
+            {'v', 3, 0, LIN_FP_SHORTEST},
+            {'%', 1, 0, LIN_FP_NONE},
+            {'d', 5, 3, LIN_FP_NONE},
+            {'f', 3, 0, LIN_FP_SPECIAL},
+        };
+        REQUIRE_INT_EQ(t.num, 10);
+        for (int n = 0; n < 10; n++) {
+            REQUIRE(t.infos[n].conv == expect[n].conv);
+            REQUIRE(t.infos[n].bytes == expect[n].bytes);
+            REQUIRE(t.infos[n].pad_bytes == expect[n].pad);
+            REQUIRE(t.infos[n].fp_path == expect[n].fp);
+        }
+        REQUIRE(t.infos[2].bignum_passes == 0);
+        REQUIRE(t.infos[3].bignum_passes > 0);
+        REQUIRE(t.infos[4].bignum_passes > 0);
+
+        // measuring only
+        r = hook_test_snprintf(&t, NULL, 0, "%-8.30f", 0.1);
+        REQUIRE_INT_EQ(r, 32);
+        REQUIRE_INT_EQ(t.num, 1);
+        REQUIRE(t.infos[0].fp_path == LIN_FP_LENGTH);
+        r = hook_test_snprintf(&t, buffer, sizeof(buffer), "%8q%4c", "a", 'x');
+        REQUIRE_STR_EQ(buffer, "     \"a\"   x");
+        REQUIRE_INT_EQ(t.num, 2);
+        REQUIRE(t.infos[0].conv == 'q' && t.infos[0].pad_bytes == 5);
+        REQUIRE(t.infos[1].conv == 'c' && t.infos[1].pad_bytes == 3);
+#else
+        REQUIRE_INT_EQ(t.num, 0);
+#endif
+    }
+
+    // callback output
+    {
+        static struct cb_test t;
+        char big[3000];
+        memset(big, 'y', sizeof(big) - 1);
+        big[sizeof(big) - 1] = '\0';
+        int r = lin_cbprintf(cb_test_append, &t, "a%d%1000s%s%.3f|",
+                             42, "x", big, 1.5);
+        REQUIRE_INT_EQ(r, 1 + 2 + 1000 + 2999 + 6);
+        REQUIRE_INT_EQ((int)t.len, r);
+        REQUIRE(t.calls > 1);
+        REQUIRE(!memcmp(t.buf, "a42   ", 6));
+        REQUIRE(!strcmp(t.buf + t.len - 7, "y1.500|"));
+        t.len = t.calls = 0;
+        r = lin_cbprintf(cb_test_append, &t, "%s", "");
+        REQUIRE_INT_EQ(r, 0);
+        REQUIRE_INT_EQ(t.calls, 0);
+    }
+
+    // iovec output
+    {
+        struct lin_iovec iov[8];
+        char scratch[64], big[300], out[1000];
+        memset(big, 'y', sizeof(big) - 1);
+        big[sizeof(big) - 1] = '\0';
+        size_t n = 8;
+        int r = lin_format_iov(iov, &n, scratch, sizeof(scratch), 100,
+                               "[%d] %s|%-302s|%.3s%s", -5, big, big, big, "ab");
+        REQUIRE_INT_EQ(r, 5 + 299 + 1 + 302 + 1 + 3 + 2);
+        REQUIRE_INT_EQ((int)n, 5);
+        REQUIRE(iov[0].iov_base == scratch && iov[0].iov_len == 5);
+        REQUIRE(iov[1].iov_base == big && iov[1].iov_len == 299);
+        REQUIRE(iov[2].iov_len == 1);
+        REQUIRE(iov[3].iov_base == big && iov[3].iov_len == 299);
+        REQUIRE(iov[4].iov_len == 3 + 1 + 3 + 2);
+        size_t len = 0;
+        for (size_t i = 0; i < n; i++) {
+            memcpy(out + len, iov[i].iov_base, iov[i].iov_len);
+            len += iov[i].iov_len;
+        }
+        out[len] = '\0';
+        REQUIRE_INT_EQ((int)len, r);
+        REQUIRE(!strncmp(out, "[-5] yy", 7));
+        REQUIRE_STR_EQ(out + len - 12, "yyy   |yyyab");
+
+        // short strings and no references
+        n = 8;
+        r = lin_format_iov(iov, &n, scratch, sizeof(scratch), 0, "%s%s", "", "x");
+        REQUIRE_INT_EQ(r, 1);
+        REQUIRE((int)n == 1 && iov[0].iov_base != scratch);
+        n = 8;
+        r = lin_format_iov(iov, &n, scratch, sizeof(scratch), 100, "%s", "");
+        REQUIRE(r == 0 && n == 0);
+
+        // truncation: scratch or iov full
+        n = 8;
+        r = lin_format_iov(iov, &n, scratch, 4, 100, "%d%s", 123456, big);
+        REQUIRE_INT_EQ(r, 6 + 299);
+        REQUIRE((int)n == 1 && iov[0].iov_len == 4);
+        n = 2;
+        r = lin_format_iov(iov, &n, scratch, sizeof(scratch), 100, "a%sb%s",
+                           big, big);
+        REQUIRE_INT_EQ(r, 2 + 2 * 299);
+        REQUIRE((int)n == 2 && iov[1].iov_base == big);
+        n = 1;
+        r = lin_format_iov(iov, &n, scratch, sizeof(scratch), 100, "a%sb%s",
+                           big, big);
+        REQUIRE((int)n == 1 && iov[0].iov_len == 1);
+    }
+
+    // integer to chars
+    {
+        char d[LIN_TOA_MAX + 1] = {0};
+        REQUIRE_INT_EQ(lin_u64toa(d, sizeof(d), UINT64_MAX, 10), 20);
+        REQUIRE_STR_EQ(d, "18446744073709551615");
+        memset(d, 0, sizeof(d));
+        REQUIRE_INT_EQ(lin_u64toa(d, sizeof(d), 0, 10), 1);
+        REQUIRE_STR_EQ(d, "0");
+        REQUIRE_INT_EQ(lin_u64toa(d, sizeof(d), 0xdeadbeef12345678, 16), 16);
+        REQUIRE_STR_EQ(d, "deadbeef12345678");
+        memset(d, 0, sizeof(d));
+        REQUIRE_INT_EQ(lin_u64toa(d, sizeof(d), 0644, 8), 3);
+        REQUIRE_STR_EQ(d, "644");
+        REQUIRE_INT_EQ(lin_i64toa(d, sizeof(d), INT64_MIN, 2), LIN_TOA_MAX);
+        REQUIRE(d[0] == '-' && d[1] == '1' && d[2] == '0' && d[64] == '0');
+        memset(d, 0, sizeof(d));
+        REQUIRE_INT_EQ(lin_i64toa(d, sizeof(d), INT64_MIN, 10), 20);
+        REQUIRE_STR_EQ(d, "-9223372036854775808");
+        memset(d, 0, sizeof(d));
+        REQUIRE_INT_EQ(lin_i64toa(d, 4, -123, 10), 4);
+        REQUIRE_STR_EQ(d, "-123");
+        REQUIRE_INT_EQ(lin_i64toa(d, 3, -123, 10), -1);
+        REQUIRE_INT_EQ(lin_i64toa(d, 0, -1, 10), -1);
+        REQUIRE_INT_EQ(lin_u32toa(d, 3, 1000, 10), -1);
+        REQUIRE_STR_EQ(d, "-123");
+        REQUIRE_INT_EQ(lin_u32toa(d, 8, UINT32_MAX, 16), 8);
+        REQUIRE_STR_EQ(d, "ffffffff");
+        REQUIRE_INT_EQ(lin_u32toa(d, sizeof(d), 1, 36), -1);
+    }
+
+    // string builder
+    {
+        struct alloc_test t = { .fail_after = 100 };
+        struct lin_strbuf sb = { .realloc_cb = alloc_test_realloc, .ctx = &t };
+        char big[1000];
+        int r;
+        memset(big, 'y', sizeof(big) - 1);
+        big[sizeof(big) - 1] = '\0';
+        r = lin_strbuf_printf(&sb, "%s", "");
+        REQUIRE_INT_EQ(r, 0);
+        r = lin_strbuf_printf(&sb, "%d,", 123);
+        REQUIRE_INT_EQ(r, 4);
+        REQUIRE_STR_EQ(sb.str, "123,");
+        REQUIRE_INT_EQ(t.calls, 1);
+        r = lin_strbuf_printf(&sb, "%s|%5.1f", big, 2.25);
+        REQUIRE_INT_EQ(r, 1005);
+        REQUIRE_INT_EQ((int)sb.len, 1009);
+        REQUIRE(sb.size > sb.len);
+        REQUIRE(!strncmp(sb.str, "123,yyy", 7));
+        REQUIRE_STR_EQ(sb.str + 1002, "y|  2.2");
+        r = lin_strbuf_printf(&sb, "%w");
+        REQUIRE_INT_EQ(r, -1);
+        REQUIRE_INT_EQ((int)sb.len, 1009);
+        REQUIRE_STR_EQ(sb.str + 1002, "y|  2.2");
+        t.fail_after = t.calls;
+        r = lin_strbuf_printf(&sb, "%s%s", big, big);
+        REQUIRE_INT_EQ(r, -1);
+        REQUIRE_INT_EQ((int)sb.len, 1009);
+        REQUIRE_STR_EQ(sb.str + 1002, "y|  2.2");
+        // Once growing fails, the rest of the output is only counted: a huge
+        // width doesn't retry growing for every block of padding.
+        volatile int huge = INT_MAX;
+        int calls = t.calls;
+        r = lin_strbuf_printf(&sb, "%*d", huge, 1);
+        REQUIRE_INT_EQ(r, -1);
+        REQUIRE_INT_EQ(t.calls - calls, 1);
+        REQUIRE_INT_EQ((int)sb.len, 1009);
+        lin_strbuf_free(&sb);
+        REQUIRE(!sb.str && !sb.len && !sb.size);
+    }
+
+    printf("All lin tests succeeded.\n");
+}
+#pragma GCC diagnostic pop
+
 int main()
 {
     #if !TEST_NON_STANDARD && !TEST_IMPL_DEFINED
@@ -737,6 +1411,7 @@ int main()
 
     printf("Testing libinsanity snprintf...\n");
     run_test(lin_snprintf);
+    run_lin_test();
 
     return 0;
 }
@@ -64,6 +64,19 @@ int main()
     printf("Testing lin_snprintf() + system strtod()...\n");
     err |= run_test(lin_snprintf, strtod);
 
+    printf("Testing lin_snprintf() %%v + lin_strtod()...\n");
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Wformat"
+    #pragma GCC diagnostic ignored "-Wformat-extra-args"
+    for (int i = 0; i < 1000; i++) {
+        char buf[40];
+        double d2;
+        double d = sin(i) * pow(10, i % 600 - 300);
+        lin_snprintf(buf, sizeof buf, "%v", d);
+        TEST3(d2, lin_strtod(buf, 0), d, "round trip fail %a != %a (%a)");
+    }
+    #pragma GCC diagnostic pop
+
     if (!err)
         printf("All tests succeeded.\n");
     return err ? 1 : 0;